@@ -0,0 +1,167 @@
+// Microbenchmark for Qxl_hash_str, built and run by `make bench_hash`.
+// Times the hash on identifier-sized keys and on long strings against the
+// byte at a time FNV-1a, and counts the probes each of them takes in an open
+// addressing table laid out like QxlHashTable.
+#include "../src/include/common.h"
+
+#define IDENTIFIERS 4096
+#define TABLE_KEYS 100000
+
+typedef uint32_t (*HashFn)(const char *key, int length);
+
+static uint32_t
+fnv1a(const char *key, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static const struct
+{
+    const char *name;
+    HashFn fn;
+} hashes[] = {
+    {"Qxl_hash_str", Qxl_hash_str},
+    {"fnv1a", fnv1a},
+};
+
+#define HASH_COUNT (int)(sizeof(hashes) / sizeof(hashes[0]))
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile uint32_t sink;
+
+// Hashes the keys over and over for about a fifth of a second, returns the
+// nanoseconds a key took
+static double
+time_keys(HashFn fn, char **keys, int *lengths, int count)
+{
+    long hashed  = 0;
+    uint32_t x   = 0;
+    double start = now();
+    double elapsed;
+    do
+    {
+        for (int i = 0; i < count; i++)
+        {
+            x ^= fn(keys[i], lengths[i]);
+        }
+        hashed += count;
+        elapsed = now() - start;
+    } while (elapsed < 0.2);
+
+    sink = x;
+    return elapsed * 1e9 / hashed;
+}
+
+// Average probes per key once all of them are in a table of the smallest
+// power of two capacity that keeps the load under 0.75
+static double
+probes(HashFn fn, char **keys, int *lengths, int count)
+{
+    int cap = 8;
+    while (count > cap * 0.75)
+    {
+        cap *= 2;
+    }
+
+    bool *used = (bool *)calloc(cap, sizeof(bool));
+    long total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t index = fn(keys[i], lengths[i]) & (cap - 1);
+        total++;
+        while (used[index])
+        {
+            index = (index + 1) & (cap - 1);
+            total++;
+        }
+        used[index] = true;
+    }
+
+    free(used);
+    return (double)total / count;
+}
+
+static char *
+make_key(const char *format, int n, int *length)
+{
+    char *key = Qxl_fstr(format, n);
+    *length   = (int)strlen(key);
+    return key;
+}
+
+static void
+free_keys(char **keys, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free(keys[i]);
+    }
+}
+
+int
+main(void)
+{
+    static const char *formats[] = {"i%d", "x%d", "count%d", "item_%d",
+                                    "total_bytes_%d"};
+    static char *keys[IDENTIFIERS];
+    static int lengths[IDENTIFIERS];
+    static char *table_keys[TABLE_KEYS];
+    static int table_lengths[TABLE_KEYS];
+
+    // Names as short as a loop counter and as long as a descriptive one
+    for (int i = 0; i < IDENTIFIERS; i++)
+    {
+        keys[i] = make_key(formats[i % 5], i, &lengths[i]);
+    }
+
+    // Sequential names are what the globals and constants of a generated
+    // script look like, and where a weak hash clusters
+    for (int i = 0; i < TABLE_KEYS; i++)
+    {
+        table_keys[i] = make_key("v%d", i, &table_lengths[i]);
+    }
+    printf("%-14s %12s", "", "identifiers");
+
+    static const int sizes[] = {64, 4096, 1 << 20};
+    char *payload            = (char *)malloc(sizes[2]);
+    for (int i = 0; i < sizes[2]; i++)
+    {
+        payload[i] = (char)('a' + (i * 7 + i / 13) % 26);
+    }
+    for (int s = 0; s < 3; s++)
+    {
+        printf(" %11dB", sizes[s]);
+    }
+    printf(" %14s\n", "probes/key");
+
+    for (int h = 0; h < HASH_COUNT; h++)
+    {
+        printf("%-14s %9.1f ns", hashes[h].name,
+               time_keys(hashes[h].fn, keys, lengths, IDENTIFIERS));
+        for (int s = 0; s < 3; s++)
+        {
+            double ns = time_keys(hashes[h].fn, &payload, (int *)&sizes[s], 1);
+            printf(" %7.2f GB/s", sizes[s] / ns);
+        }
+        printf(" %14.2f\n", probes(hashes[h].fn, table_keys, table_lengths,
+                                   TABLE_KEYS));
+    }
+
+    free_keys(keys, IDENTIFIERS);
+    free_keys(table_keys, TABLE_KEYS);
+    free(payload);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "include/arena.h"
+
+#define ALIGN(size)                                                            \
+    (((size) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+void
+QxlArena_init(QxlArena *arena)
+{
+    arena->blocks = NULL;
+}
+
+void *
+QxlArena_allocate(QxlArena *arena, size_t size)
+{
+    size                 = ALIGN(size);
+    QxlArenaBlock *block = arena->blocks;
+    if (block == NULL || block->used + size > block->cap)
+    {
+        size_t cap = size > QXL_ARENA_BLOCK_SIZE ? size : QXL_ARENA_BLOCK_SIZE;
+        block      = malloc(sizeof(QxlArenaBlock) + cap);
+        if (block == NULL)
+        {
+            exit(1);
+        }
+        block->used = 0;
+        block->cap  = cap;
+
+        // A block made for one large request leaves the current one in front
+        if (cap == size && arena->blocks != NULL)
+        {
+            block->next         = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+        else
+        {
+            block->next   = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    void *result = (uint8_t *)block->data + block->used;
+    block->used += size;
+    return memset(result, 0, size);
+}
+
+void
+QxlArena_free(QxlArena *arena)
+{
+    QxlArenaBlock *block = arena->blocks;
+    while (block != NULL)
+    {
+        QxlArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
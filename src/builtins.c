@@ -2,19 +2,14 @@
 #include "include/common.h"
 #include "include/object.h"
 #include "include/quixil.h"
+#include "include/snapshot.h"
 #include "include/value.h"
 
 typedef struct VM VM;
 
 #define BUILTIN(name)                                                          \
-    static bool builtin_##name(VM *vm, int arg_count, QxlValue *args)
-#define ADD_BUILTIN(name) Qxl_add_builtin(vm, #name, builtin_##name)
-#define VALIDATE_ARGS(arg_count, req_count, has_default)                       \
-    ((arg_count == 0 && has_default) || (arg_count == req_count))
-#define ARGS_ERROR(name, req_count)                                            \
-    char *err = Qxl_fstr("%s() takes exactly %d arguments (%d given)", name,   \
-                         req_count, arg_count);                                \
-    args[-1]  = OBJECT_VAL(QxlString_copy(vm, err, strlen(err)));
+    static QxlValue builtin_##name(VM *vm, int arg_count, QxlValue *args)
+#define BUILTIN_ERROR(message) (vm->builtin_error = (message), UNDEFINED_VAL)
 
 /*
     clock as builtin_clock
@@ -23,8 +18,10 @@ typedef struct VM VM;
 */
 BUILTIN(clock)
 {
-    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-    return true;
+    (void)vm;
+    (void)arg_count;
+    (void)args;
+    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
 /*
@@ -35,24 +32,12 @@ BUILTIN(clock)
     Read a string from standard input. The trailing newline is stripped.
     The prompt string, if given, is printed to standard output without a
     trailing newline before reading input. Echoing to console is disabled
-    if hidden is true.
+    if hidden is true. Returns nil at the end of input.
 */
 BUILTIN(input)
 {
-    if (!VALIDATE_ARGS(arg_count, 2, true))
-    {
-        ARGS_ERROR("input", 2);
-        return false;
-    }
-
-    char *prompt = NULL;
-    bool hidden  = false;
-
-    if (arg_count == 2)
-    {
-        prompt = AS_STRING(args[0])->chars;
-        hidden = AS_BOOL(args[1]);
-    }
+    char *prompt = arg_count > 0 ? AS_STRING(args[0])->chars : NULL;
+    bool hidden  = arg_count > 1 && AS_BOOL(args[1]);
 
     if (!isatty(STDIN_FILENO))
     {
@@ -142,7 +127,13 @@ BUILTIN(input)
     else
     {
         // Regular input without hiding
-        getline(&input, &size, stdin);
+        if (getline(&input, &size, stdin) < 0)
+        {
+            free(input);
+            return ferror(stdin)
+                       ? BUILTIN_ERROR("could not read from standard input")
+                       : NIL_VAL;
+        }
         length = strlen(input);
 
         if (length > 0 && input[length - 1] == '\n')
@@ -152,25 +143,155 @@ BUILTIN(input)
         }
     }
 
-    input    = realloc(input, sizeof(char) * (length + 1));
-    args[-1] = OBJECT_VAL(QxlString_copy(vm, input, length));
-    return true;
+    QxlString *line = QxlString_new(vm, input, length);
+    free(input);
+    return OBJECT_VAL(line);
 }
 
+#define HEAP_STATS_TOP_LINES 10
+
+/*
+    heapStats as builtin_heapStats
+    Collects garbage and returns a report of what is left on the heap: the
+    live objects of each type, the intern and globals tables and the bytes
+    taken by the chunks, the slab pages and the page faults of the process.
+    Builds with DEBUG_SAMPLE_ALLOCATIONS also list the source lines that
+    allocated the most so far.
+*/
+BUILTIN(heapStats)
+{
+    (void)arg_count;
+    (void)args;
+    QxlHeapStats stats = vm_heap_stats(vm);
+    char report[2048];
+    int length = 0;
+
+    // A report that does not fit is cut off at the end of the buffer
+#define REPORT(...)                                                            \
+    do                                                                         \
+    {                                                                          \
+        length += snprintf(report + length, sizeof(report) - length,          \
+                           __VA_ARGS__);                                       \
+        if (length > (int)sizeof(report) - 1) length = sizeof(report) - 1;    \
+    } while (false)
+
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+    {
+        REPORT("%-10s %8zu objects %10zu bytes\n", QxlObject_type_names[type],
+               stats.objects[type], stats.object_bytes[type]);
+    }
+    REPORT("strings    %d of %d slots used, load %.2f\n", stats.strings_count,
+           stats.strings_cap,
+           stats.strings_cap > 0
+               ? (double)stats.strings_count / stats.strings_cap
+               : 0.0);
+    REPORT("globals    %d of %d slots used\n", stats.globals_count,
+           stats.globals_cap);
+    REPORT("chunks     %zu code, %zu line and %zu constant bytes\n",
+           stats.code_bytes, stats.line_bytes, stats.constant_bytes);
+    REPORT("heap       %zu bytes allocated, %zu bytes from the image\n",
+           stats.bytes_allocated, stats.image_bytes);
+    REPORT("slabs      %zu pages used, %zu given back\n", stats.slab_pages,
+           stats.slab_pages_discarded);
+    REPORT("faults     %ld minor, %ld major", stats.minor_faults,
+           stats.major_faults);
+
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+    // Keep the lines that allocated the most, largest first
+    int top[HEAP_STATS_TOP_LINES];
+    int top_count = 0;
+    for (int line = 0; line < stats.sampled_lines; line++)
+    {
+        size_t bytes = stats.sampled_bytes[line];
+        if (bytes == 0) continue;
+        if (top_count == HEAP_STATS_TOP_LINES &&
+            stats.sampled_bytes[top[top_count - 1]] >= bytes)
+        {
+            continue;
+        }
+
+        // Insert in order, the smallest one falls off a full list
+        int i = top_count < HEAP_STATS_TOP_LINES ? top_count++ : top_count - 1;
+        while (i > 0 && stats.sampled_bytes[top[i - 1]] < bytes)
+        {
+            top[i] = top[i - 1];
+            i--;
+        }
+        top[i] = line;
+    }
+
+    for (int i = 0; i < top_count; i++)
+    {
+        if (top[i] == 0)
+        {
+            REPORT("\n<outside>  ~%zu bytes", stats.sampled_bytes[0]);
+            continue;
+        }
+        REPORT("\nline %-5d ~%zu bytes", top[i], stats.sampled_bytes[top[i]]);
+    }
+#endif
+
+#undef REPORT
+
+    return OBJECT_VAL(QxlString_new(vm, report, length));
+}
+
+/*
+    heapSnapshot as builtin_heapSnapshot
+        path: string
+
+    Collects garbage and writes every object left on the heap to the file at
+    path, with its type, size, allocation line and the objects it references.
+    Two snapshots can be compared with `quixil --heap-diff before after`.
+*/
+BUILTIN(heapSnapshot)
+{
+    (void)arg_count;
+    FILE *file = fopen(AS_CSTRING(args[0]), "w");
+    if (file == NULL) return BUILTIN_ERROR("could not open the snapshot file");
+
+    bool written = QxlSnapshot_write(vm, file);
+    if (fclose(file) != 0 || !written)
+    {
+        return BUILTIN_ERROR("could not write the snapshot file");
+    }
+    return NIL_VAL;
+}
+
+static const QxlBuiltinDef builtins[] = {
+    {"clock", builtin_clock, 0, 0, {ARG_ANY}},
+    {"input", builtin_input, 0, 2, {ARG_STRING, ARG_BOOL}},
+    {"heapStats", builtin_heapStats, 0, 0, {ARG_ANY}},
+    {"heapSnapshot", builtin_heapSnapshot, 1, 1, {ARG_STRING}},
+};
+
 static void
-Qxl_add_builtin(VM *vm, const char *name, BuiltinFn fn)
+Qxl_add_builtin(VM *vm, const QxlBuiltinDef *def)
 {
-    QxlString *fn_name = QxlString_copy(vm, name, (int)strlen(name));
+    QxlString *fn_name = QxlString_copy(vm, def->name, (int)strlen(def->name));
     vm_stack_push(vm, OBJECT_VAL(fn_name));
-    vm_stack_push(vm, OBJECT_VAL(QxlBuiltin_new(vm, fn_name, fn)));
-    QxlHashTable_put(&vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    vm_stack_push(vm, OBJECT_VAL(QxlBuiltin_new(vm, fn_name, def)));
+    int slot                       = vm_global_slot(vm, fn_name);
+    vm->global_values.values[slot] = vm->stack[1];
     vm_stack_pop(vm);
     vm_stack_pop(vm);
 }
 
+const QxlBuiltinDef *
+builtins_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        if (strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    }
+    return NULL;
+}
+
 void
 builtins_init(VM *vm)
 {
-    ADD_BUILTIN(clock);
-    ADD_BUILTIN(input);
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        Qxl_add_builtin(vm, &builtins[i]);
+    }
 }
\ No newline at end of file
@@ -43,3 +43,123 @@ QxlChunk_free(QxlChunk *chunk)
     QxlValueList_free(&chunk->constants);
     QxlChunk_init(chunk);
 }
+
+int
+QxlChunk_instruction_length(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CALL_BUILTIN:
+    case OP_BUILD_STRING:
+        return 2;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_ADD_LOCALS:
+        return 3;
+    case OP_LESS_LOCAL_CONST_JUMP:
+        return 5;
+    default:
+        return 1;
+    }
+}
+
+// Net number of values the instruction at `offset` pushes
+static int
+stack_effect(QxlChunk *chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_DUP:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_ADD_LOCALS:
+        return 1;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CALL_BUILTIN:
+        return -chunk->code[offset + 1];
+    case OP_BUILD_STRING:
+        return 1 - chunk->code[offset + 1];
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_LESS_LOCAL_CONST_JUMP:
+        return 0;
+    default:
+        // Binary operators, OP_PRINT, OP_POP, OP_DEFINE_GLOBAL,
+        // OP_SET_LOCAL_POP, OP_POP_JUMP_IF_FALSE and OP_RETURN
+        return -1;
+    }
+}
+
+int
+QxlChunk_max_depth(QxlChunk *chunk, int slots)
+{
+    int count   = chunk->count;
+    int *depths = QxlMem_Allocate(int, count + 1);
+    for (int offset = 0; offset <= count; offset++)
+    {
+        depths[offset] = -1;
+    }
+
+    int depth      = slots;
+    int max        = slots;
+    bool reachable = true;
+    for (int offset = 0; offset < count;)
+    {
+        // Code after an unconditional jump is only entered by jumping to it
+        if (depths[offset] != -1 && (!reachable || depths[offset] > depth))
+        {
+            depth = depths[offset];
+        }
+        reachable = true;
+
+        uint8_t op = chunk->code[offset];
+        int next   = offset + QxlChunk_instruction_length(op);
+        depth += stack_effect(chunk, offset);
+        if (depth > max) max = depth;
+
+        switch (op)
+        {
+        case OP_JUMP:
+            reachable = false;
+            // Fallthrough
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_LESS_LOCAL_CONST_JUMP:
+        {
+            int target = next + ((chunk->code[next - 2] << 8) |
+                                 chunk->code[next - 1]);
+            if (depth > depths[target]) depths[target] = depth;
+            break;
+        }
+        case OP_LOOP:
+        case OP_RETURN:
+            reachable = false;
+            break;
+        }
+        offset = next;
+    }
+
+    QxlMem_Free_Array(int, depths, count + 1);
+    return max;
+}
@@ -3,11 +3,15 @@
 #include "include/object.h"
 #include "include/value.h"
 
+// Capacities are powers of two, QxlMem_Resize doubles them from 8, so the
+// probes wrap around with a mask
+#define WRAP(index, cap) ((index) & (uint32_t)((cap)-1))
+
 static HashTableEntry *
 find_entry(HashTableEntry *entries, int cap, QxlString *k)
 {
     HashTableEntry *tombstone = NULL;
-    uint32_t index            = k->hash % cap;
+    uint32_t index            = WRAP(QxlString_hash(k), cap);
 
     for (;;)
     {
@@ -31,7 +35,7 @@ find_entry(HashTableEntry *entries, int cap, QxlString *k)
             return entry;
         }
 
-        index = (index + 1) % cap;
+        index = WRAP(index + 1, cap);
     }
 }
 
@@ -143,7 +147,7 @@ QxlHashTable_find_string(QxlHashTable *t, const char *chars, int length,
 {
     if (t->count == 0) return NULL;
 
-    uint32_t index = hash % t->cap;
+    uint32_t index = WRAP(hash, t->cap);
     for (;;)
     {
         HashTableEntry *entry = &t->entries[index];
@@ -157,6 +161,19 @@ QxlHashTable_find_string(QxlHashTable *t, const char *chars, int length,
             return entry->key;
         }
 
-        index = (index + 1) % t->cap;
+        index = WRAP(index + 1, t->cap);
+    }
+}
+
+void
+QxlHashTable_remove_unmarked(QxlHashTable *t)
+{
+    for (int i = 0; i < t->cap; i++)
+    {
+        HashTableEntry *entry = &t->entries[i];
+        if (entry->key != NULL && !entry->key->obj.is_marked)
+        {
+            QxlHashTable_remove(t, entry->key);
+        }
     }
 }
@@ -3,9 +3,11 @@
 char *
 Qxl_fstr(const char *format, ...)
 {
-    va_list args;
+    va_list args, args_copy;
     va_start(args, format);
-    size_t len = vsnprintf(NULL, 0, format, args);
+    va_copy(args_copy, args);
+    size_t len = vsnprintf(NULL, 0, format, args_copy);
+    va_end(args_copy);
 
     char *result = (char *)malloc((len + 1) * sizeof(char));
     if (result == NULL)
@@ -19,6 +21,132 @@ Qxl_fstr(const char *format, ...)
     return result;
 }
 
+#ifdef WIDE_HASH
+
+// The final version of wyhash by Wang Yi (public domain), reading the key in
+// native byte order. Keys of up to 16 bytes take a few loads and two
+// multiplications, longer ones are mixed 16 or 48 bytes at a time.
+static const uint64_t wy_secret[4] = {
+    0x2d358dccaa6c78a5ull,
+    0x8bb84b93962eacc9ull,
+    0x4b33a62ed433d4a3ull,
+    0x4d5a2da51de1aa47ull,
+};
+
+// Full 128 bit product of `*a` and `*b`, low half in `*a`, high in `*b`
+static inline void
+wy_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a            = (uint64_t)r;
+    *b            = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t
+wy_mix(uint64_t a, uint64_t b)
+{
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t
+wy_read8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t
+wy_read4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Keys of 1 to 3 bytes, read as their first, middle and last byte
+static inline uint64_t
+wy_read3(const uint8_t *p, size_t k)
+{
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+uint32_t
+Qxl_hash_str(const char *key, int length)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    size_t len       = (size_t)length;
+    uint64_t seed    = wy_mix(wy_secret[0], wy_secret[1]);
+    uint64_t a, b;
+
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+            b = (wy_read4(p + len - 4) << 32) |
+                wy_read4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = wy_read3(p, len);
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i > 48)
+        {
+            uint64_t see1 = seed, see2 = seed;
+            do
+            {
+                seed = wy_mix(wy_read8(p) ^ wy_secret[1],
+                              wy_read8(p + 8) ^ seed);
+                see1 = wy_mix(wy_read8(p + 16) ^ wy_secret[2],
+                              wy_read8(p + 24) ^ see1);
+                see2 = wy_mix(wy_read8(p + 32) ^ wy_secret[3],
+                              wy_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            seed = wy_mix(wy_read8(p) ^ wy_secret[1], wy_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wy_read8(p + i - 16);
+        b = wy_read8(p + i - 8);
+    }
+
+    a ^= wy_secret[1];
+    b ^= seed;
+    wy_mum(&a, &b);
+    uint64_t hash = wy_mix(a ^ wy_secret[0] ^ len, b ^ wy_secret[1]);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+#else
+
 uint32_t
 Qxl_hash_str(const char *key, int length)
 {
@@ -31,10 +159,4 @@ Qxl_hash_str(const char *key, int length)
     return hash;
 }
 
-char *
-Qxl_num_as_str(int value)
-{
-    char *str = NULL;
-    asprintf(&str, "%d", value);
-    return str;
-}
\ No newline at end of file
+#endif
@@ -1,5 +1,7 @@
 #include "include/compiler.h"
 #include "include/debug.h"
+#include "include/memory.h"
+#include "include/register.h"
 
 #define STATEMENT(type) static void stmt##type(Compiler *c)
 #define DEFINITION(type) static void def##type(Compiler *c)
@@ -8,19 +10,27 @@
 #define PARSER_ERROR(m) error_at(c->p, &c->p->prev, (m))
 #define PARSER_ERROR_AT_CUR(m) error_at(c->p, &c->p->cur, (m))
 #define EMIT_BYTE(byte) QxlChunk_add(&c->fn->chunk, (byte), c->p->prev.line)
-#define EMIT_BYTES(byte_1, byte_2) (EMIT_BYTE(byte_1), EMIT_BYTE(byte_2))
-#define EMIT_CONST(val) EMIT_BYTES(OP_CONSTANT, make_constant(c, val))
-#define EMIT_RETURN() EMIT_BYTES(OP_NIL, OP_RETURN)
+#define EMIT_OP(op) (mark_instruction(c), EMIT_BYTE(op))
+#define EMIT_BYTES(op, operand) (EMIT_OP(op), EMIT_BYTE(operand))
+#define EMIT_SHORT(op, operand)                                                \
+    (EMIT_OP(op), EMIT_BYTE(((operand) >> 8) & 0xff),                          \
+     EMIT_BYTE((operand)&0xff))
+#define EMIT_CONST(val)                                                        \
+    ({                                                                         \
+        uint8_t constant = make_constant(c, (val));                            \
+        EMIT_BYTES(OP_CONSTANT, constant);                                     \
+    })
+#define EMIT_RETURN() (EMIT_OP(OP_NIL), EMIT_OP(OP_RETURN))
 #define EMIT_JUMP(inst)                                                        \
     ({                                                                         \
-        EMIT_BYTE(inst);                                                       \
+        EMIT_OP(inst);                                                         \
         EMIT_BYTE(0xff);                                                       \
         EMIT_BYTE(0xff);                                                       \
         c->fn->chunk.count - 2;                                                \
     })
 #define EMIT_LOOP(start)                                                       \
     {                                                                          \
-        EMIT_BYTE(OP_LOOP);                                                    \
+        EMIT_OP(OP_LOOP);                                                      \
         int offset = c->fn->chunk.count - (start) + 2;                         \
         if (offset > UINT16_MAX) PARSER_ERROR("loop body too large");          \
         EMIT_BYTE((offset >> 8) & 0xff);                                       \
@@ -35,6 +45,7 @@
         }                                                                      \
         c->fn->chunk.code[offset]     = (jump >> 8) & 0xff;                    \
         c->fn->chunk.code[offset + 1] = jump & 0xff;                           \
+        c->jump_target                = c->fn->chunk.count;                    \
     }
 #define CHECK_TYPE(_type) (c->p->cur.type == (_type))
 #define MATCH_TOKEN(_type) (CHECK_TYPE(_type) ? (advance(c), true) : false)
@@ -42,9 +53,8 @@
     ((CHECK_TYPE(TOKEN_TRUE) || CHECK_TYPE(TOKEN_FALSE) ||                     \
       CHECK_TYPE(TOKEN_NIL) || CHECK_TYPE(TOKEN_NUMBER) ||                     \
       CHECK_TYPE(TOKEN_STRING)))
-#define CONST_IDENTIFIER(token)                                                \
-    (make_constant(                                                            \
-        c, OBJECT_VAL(QxlString_copy(c->p->vm, token.start, token.length))))
+#define GLOBAL_IDENTIFIER(token)                                               \
+    (global_slot(c, QxlString_copy(c->p->vm, token.start, token.length)))
 #define MARK_INITIALIZED()                                                     \
     if (c->scope_depth > 0) c->locals[c->local_count - 1].depth = c->scope_depth
 #define DEFINE_VAR(v)                                                          \
@@ -54,11 +64,11 @@
             MARK_INITIALIZED();                                                \
         }                                                                      \
         else                                                                   \
-            EMIT_BYTES(OP_DEFINE_GLOBAL, v);                                   \
+            EMIT_SHORT(OP_DEFINE_GLOBAL, v);                                   \
     }
 
 #define NAMED_VARIABLE()                                                       \
-    (EMIT_BYTES(OP_GET_GLOBAL, (uint8_t)CONST_IDENTIFIER(c->p->prev)))
+    (EMIT_SHORT(OP_GET_GLOBAL, GLOBAL_IDENTIFIER(c->p->prev)))
 #define SCOPE_BEGIN() (c->scope_depth++)
 #define SCOPE_END() (c->scope_depth--)
 #define IDENTIFIERS_EQUAL(a, b)                                                \
@@ -128,6 +138,37 @@ ParseRule rules[] = {
     [TOKEN_EOF]           = {NULL, NULL, PREC_NONE},
 };
 
+// Superinstructions are fused by rewinding over the instructions they replace.
+// That is only safe when they were emitted back to back and no jump lands
+// between them, `ops` keeps the offsets of the last few instructions and
+// `jump_target` the furthest offset a patched jump lands on.
+#define LAST_OP(i) (c->ops[(i)] < 0 ? -1 : c->fn->chunk.code[c->ops[(i)]])
+
+static void
+mark_instruction(Compiler *c)
+{
+    c->ops[2] = c->ops[1];
+    c->ops[1] = c->ops[0];
+    c->ops[0] = c->fn->chunk.count;
+}
+
+// Returns the offset of the oldest of the last `count` instructions if they
+// can be replaced by a superinstruction, -1 otherwise.
+static int
+fusable_from(Compiler *c, int count)
+{
+    int start = c->ops[count - 1];
+    if (start < 0 || c->jump_target > start) return -1;
+    return start;
+}
+
+static void
+rewind_to(Compiler *c, int offset)
+{
+    c->fn->chunk.count = offset;
+    c->ops[0] = c->ops[1] = c->ops[2] = -1;
+}
+
 static ParseRule *
 get_rule(TokenType type)
 {
@@ -221,7 +262,10 @@ expression(Compiler *c)
 static uint8_t
 make_constant(Compiler *c, QxlValue value)
 {
+    // Growing the constants can collect before `value` is stored in them
+    vm_stack_push(c->p->vm, value);
     int constant = QxlChunk_add_constant(&c->fn->chunk, value);
+    vm_stack_pop(c->p->vm);
     if (constant > UINT8_MAX)
     {
         PARSER_ERROR("too many constants in one chunk");
@@ -231,6 +275,21 @@ make_constant(Compiler *c, QxlValue value)
     return (uint8_t)constant;
 }
 
+// Globals are resolved to the index of their slot in the VM while compiling,
+// the name only matters again when reporting an undefined variable.
+static int
+global_slot(Compiler *c, QxlString *name)
+{
+    int slot = vm_global_slot(c->p->vm, name);
+    if (slot > UINT16_MAX)
+    {
+        PARSER_ERROR("too many global variables");
+        return 0;
+    }
+
+    return slot;
+}
+
 static void
 scope_end(Compiler *c)
 {
@@ -239,7 +298,7 @@ scope_end(Compiler *c)
     while (c->local_count > 0 &&
            c->locals[c->local_count - 1].depth > c->scope_depth)
     {
-        EMIT_BYTE(OP_POP);
+        EMIT_OP(OP_POP);
         c->local_count--;
     }
 }
@@ -275,7 +334,7 @@ static void
 and_(Compiler *c, bool can_assign)
 {
     int end_jump = EMIT_JUMP(OP_JUMP_IF_FALSE);
-    EMIT_BYTE(OP_POP);
+    EMIT_OP(OP_POP);
     parse_precedence(c, PREC_AND);
     PATCH_JUMP(end_jump);
 }
@@ -286,7 +345,7 @@ or_(Compiler *c, bool can_assign)
     int else_jump = EMIT_JUMP(OP_JUMP_IF_FALSE);
     int end_jump  = EMIT_JUMP(OP_JUMP);
     PATCH_JUMP(else_jump);
-    EMIT_BYTE(OP_POP);
+    EMIT_OP(OP_POP);
     parse_precedence(c, PREC_OR);
     PATCH_JUMP(end_jump);
 }
@@ -298,23 +357,36 @@ number(Compiler *c, bool can_assign)
     EMIT_CONST(NUMBER_VAL(value));
 }
 
-static void template(Compiler *c, bool can_assign)
+// Pushes a literal section of a template string, leaving out empty ones.
+// Returns the number of parts pushed.
+static int
+template_section(Compiler *c, int length)
 {
-    QxlString *s = QxlString_copy(c->p->vm, "", 0);
+    if (length == 0) return 0;
+    QxlString *s = QxlString_copy(c->p->vm, c->p->prev.start + 1, length);
     EMIT_CONST(OBJECT_VAL(s));
+    return 1;
+}
+
+// Every section and expression of the template is pushed and joined by a
+// single OP_BUILD_STRING, up to UINT8_MAX parts at a time.
+static void template(Compiler *c, bool can_assign)
+{
+    int parts = 0;
     do
     {
-        QxlString *s = QxlString_copy(c->p->vm, c->p->prev.start + 1,
-                                      c->p->prev.length - 3);
-        EMIT_CONST(OBJECT_VAL(s));
-        EMIT_BYTE(OP_ADD);
+        parts += template_section(c, c->p->prev.length - 3);
         expression(c);
-        EMIT_BYTE(OP_ADD);
-
+        parts++;
+        if (parts >= UINT8_MAX - 1)
+        {
+            EMIT_BYTES(OP_BUILD_STRING, parts);
+            parts = 1;
+        }
     } while (MATCH_TOKEN(TOKEN_INTEROP));
     consume(c, TOKEN_STRING);
-    string(c, false);
-    EMIT_BYTE(OP_ADD);
+    parts += template_section(c, c->p->prev.length - 2);
+    EMIT_BYTES(OP_BUILD_STRING, parts);
 }
 
 static void
@@ -344,16 +416,36 @@ unary(Compiler *c, bool can_assign)
     switch (op_type)
     {
     case TOKEN_BANG:
-        EMIT_BYTE(OP_NOT);
+        EMIT_OP(OP_NOT);
         break;
     case TOKEN_MINUS:
-        EMIT_BYTE(OP_NEGATE);
+        EMIT_OP(OP_NEGATE);
         break;
     default:
         return; // Unreachable
     }
 }
 
+// GET_LOCAL a, GET_LOCAL b, ADD is the most frequent sequence in function
+// bodies, it becomes a single OP_ADD_LOCALS a b.
+static void
+emit_add(Compiler *c)
+{
+    int start = fusable_from(c, 2);
+    if (start != -1 && LAST_OP(1) == OP_GET_LOCAL &&
+        LAST_OP(0) == OP_GET_LOCAL)
+    {
+        uint8_t a = c->fn->chunk.code[start + 1];
+        uint8_t b = c->fn->chunk.code[start + 3];
+        rewind_to(c, start);
+        EMIT_BYTES(OP_ADD_LOCALS, a);
+        EMIT_BYTE(b);
+        return;
+    }
+
+    EMIT_OP(OP_ADD);
+}
+
 static void
 binary(Compiler *c, bool can_assign)
 {
@@ -364,34 +456,34 @@ binary(Compiler *c, bool can_assign)
     switch (op_type)
     {
     case TOKEN_BANG_EQUAL:
-        EMIT_BYTES(OP_EQUAL, OP_NOT);
+        EMIT_OP(OP_NOT_EQUAL);
         break;
     case TOKEN_EQUAL_EQUAL:
-        EMIT_BYTE(OP_EQUAL);
+        EMIT_OP(OP_EQUAL);
         break;
     case TOKEN_GREATER:
-        EMIT_BYTE(OP_GREATER);
+        EMIT_OP(OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        EMIT_BYTES(OP_LESS, OP_NOT);
+        EMIT_OP(OP_GREATER_EQUAL);
         break;
     case TOKEN_LESS:
-        EMIT_BYTE(OP_LESS);
+        EMIT_OP(OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        EMIT_BYTES(OP_GREATER, OP_NOT);
+        EMIT_OP(OP_LESS_EQUAL);
         break;
     case TOKEN_PLUS:
-        EMIT_BYTE(OP_ADD);
+        emit_add(c);
         break;
     case TOKEN_MINUS:
-        EMIT_BYTE(OP_SUBTRACT);
+        EMIT_OP(OP_SUBTRACT);
         break;
     case TOKEN_STAR:
-        EMIT_BYTE(OP_MULTIPLY);
+        EMIT_OP(OP_MULTIPLY);
         break;
     case TOKEN_SLASH:
-        EMIT_BYTE(OP_DIVIDE);
+        EMIT_OP(OP_DIVIDE);
         break;
     default:
         return; // Unreachable
@@ -404,13 +496,13 @@ literal(Compiler *c, bool can_assign)
     switch (c->p->prev.type)
     {
     case TOKEN_FALSE:
-        EMIT_BYTE(OP_FALSE);
+        EMIT_OP(OP_FALSE);
         break;
     case TOKEN_NIL:
-        EMIT_BYTE(OP_NIL);
+        EMIT_OP(OP_NIL);
         break;
     case TOKEN_TRUE:
-        EMIT_BYTE(OP_TRUE);
+        EMIT_OP(OP_TRUE);
         break;
     default:
         return; // Unreachable
@@ -439,29 +531,31 @@ resolve_local_variable(Compiler *c, Token *name)
 static void
 named_variable(Compiler *c, bool can_assign)
 {
-    uint8_t get_op, set_op;
     int arg = resolve_local_variable(c, &c->p->prev);
 
     if (arg != -1)
     {
-        get_op = OP_GET_LOCAL;
-        set_op = OP_SET_LOCAL;
-    }
-    else
-    {
-        arg    = CONST_IDENTIFIER(c->p->prev);
-        get_op = OP_GET_GLOBAL;
-        set_op = OP_SET_GLOBAL;
+        if (can_assign && MATCH_TOKEN(TOKEN_EQUAL))
+        {
+            expression(c);
+            EMIT_BYTES(OP_SET_LOCAL, (uint8_t)arg);
+        }
+        else
+        {
+            EMIT_BYTES(OP_GET_LOCAL, (uint8_t)arg);
+        }
+        return;
     }
 
+    arg = GLOBAL_IDENTIFIER(c->p->prev);
     if (can_assign && MATCH_TOKEN(TOKEN_EQUAL))
     {
         expression(c);
-        EMIT_BYTES(set_op, (uint8_t)arg);
+        EMIT_SHORT(OP_SET_GLOBAL, arg);
     }
     else
     {
-        EMIT_BYTES(get_op, (uint8_t)arg);
+        EMIT_SHORT(OP_GET_GLOBAL, arg);
     }
 }
 
@@ -513,7 +607,7 @@ add_local(Compiler *c, Token name)
     local->depth = -1;
 }
 
-static uint8_t
+static int
 parse_variable(Compiler *c)
 {
     consume(c, TOKEN_IDENTIFIER);
@@ -539,7 +633,7 @@ parse_variable(Compiler *c)
         add_local(c, *name);
     }
 
-    return c->scope_depth > 0 ? 0 : CONST_IDENTIFIER(c->p->prev);
+    return c->scope_depth > 0 ? 0 : GLOBAL_IDENTIFIER(c->p->prev);
 }
 
 static void
@@ -558,8 +652,8 @@ define_function(Compiler *parent, FunctionType type)
             {
                 PARSER_ERROR_AT_CUR("can't have more than 255 parameters");
             }
-            uint8_t constant = parse_variable(c);
-            DEFINE_VAR(constant);
+            int global = parse_variable(c);
+            DEFINE_VAR(global);
         } while (MATCH_TOKEN(TOKEN_COMMA));
     }
 
@@ -570,12 +664,12 @@ define_function(Compiler *parent, FunctionType type)
     QxlFunction *fn = Compiler_end(c);
 
     c = parent;
-    EMIT_BYTES(OP_CONSTANT, make_constant(c, OBJECT_VAL(fn)));
+    EMIT_CONST(OBJECT_VAL(fn));
 }
 
 DEFINITION(_function)
 {
-    uint8_t global = parse_variable(c);
+    int global = parse_variable(c);
     MARK_INITIALIZED();
     define_function(c, TYPE_GENERIC);
     DEFINE_VAR(global);
@@ -584,25 +678,48 @@ DEFINITION(_function)
 // Compiles a "var" variable definition statement
 DEFINITION(_variable)
 {
-    uint8_t global = parse_variable(c);
+    int global = parse_variable(c);
     if (MATCH_TOKEN(TOKEN_EQUAL))
     {
         expression(c);
     }
     else
     {
-        EMIT_BYTE(OP_NIL);
+        EMIT_OP(OP_NIL);
     }
     consume(c, TOKEN_SEMICOLON);
     DEFINE_VAR(global);
 }
 
+// Emits the conditional jump of an "if" or a "while". Unlike the jumps of
+// "and" and "or" these always pop the condition, so the branches don't need an
+// OP_POP each. A "local < constant" condition is fused into the jump.
+static int
+emit_condition_jump(Compiler *c)
+{
+    int start = fusable_from(c, 3);
+    if (start != -1 && LAST_OP(2) == OP_GET_LOCAL &&
+        LAST_OP(1) == OP_CONSTANT && LAST_OP(0) == OP_LESS)
+    {
+        uint8_t slot     = c->fn->chunk.code[start + 1];
+        uint8_t constant = c->fn->chunk.code[start + 3];
+        rewind_to(c, start);
+        EMIT_BYTES(OP_LESS_LOCAL_CONST_JUMP, slot);
+        EMIT_BYTE(constant);
+        EMIT_BYTE(0xff);
+        EMIT_BYTE(0xff);
+        return c->fn->chunk.count - 2;
+    }
+
+    return EMIT_JUMP(OP_POP_JUMP_IF_FALSE);
+}
+
 // Statements
 STATEMENT(_print)
 {
     expression(c);
     consume(c, TOKEN_SEMICOLON);
-    EMIT_BYTE(OP_PRINT);
+    EMIT_OP(OP_PRINT);
 }
 
 STATEMENT(_if)
@@ -611,13 +728,11 @@ STATEMENT(_if)
     expression(c);
     consume(c, TOKEN_RIGHT_PAREN);
 
-    int then_jump = EMIT_JUMP(OP_JUMP_IF_FALSE);
-    EMIT_BYTE(OP_POP);
+    int then_jump = emit_condition_jump(c);
     statement(c);
     int else_jump = EMIT_JUMP(OP_JUMP);
 
     PATCH_JUMP(then_jump);
-    EMIT_BYTE(OP_POP);
 
     if (MATCH_TOKEN(TOKEN_ELSE)) statement(c);
     PATCH_JUMP(else_jump);
@@ -650,18 +765,18 @@ STATEMENT(_when)
             {
                 case_ends[case_count++] = EMIT_JUMP(OP_JUMP);
                 PATCH_JUMP(prev_case_skip);
-                EMIT_BYTE(OP_POP);
+                EMIT_OP(OP_POP);
             }
 
             if (is_next_val)
             {
                 state = 1;
-                EMIT_BYTE(OP_DUP);
+                EMIT_OP(OP_DUP);
                 expression(c);
                 consume(c, TOKEN_ARROW);
-                EMIT_BYTE(OP_EQUAL);
+                EMIT_OP(OP_EQUAL);
                 prev_case_skip = EMIT_JUMP(OP_JUMP_IF_FALSE);
-                EMIT_BYTE(OP_POP);
+                EMIT_OP(OP_POP);
             }
             else
             {
@@ -683,7 +798,7 @@ STATEMENT(_when)
     if (state == 1)
     {
         PATCH_JUMP(prev_case_skip);
-        EMIT_BYTE(OP_POP);
+        EMIT_OP(OP_POP);
     }
 
     // Patch all the case jumps to the end
@@ -692,7 +807,7 @@ STATEMENT(_when)
         PATCH_JUMP(case_ends[i]);
     }
 
-    EMIT_BYTE(OP_POP);
+    EMIT_OP(OP_POP);
 }
 
 STATEMENT(_while)
@@ -702,13 +817,11 @@ STATEMENT(_while)
     expression(c);
     consume(c, TOKEN_RIGHT_PAREN);
 
-    int exit_jump = EMIT_JUMP(OP_JUMP_IF_FALSE);
-    EMIT_BYTE(OP_POP);
+    int exit_jump = emit_condition_jump(c);
     statement(c);
     EMIT_LOOP(loop_start);
 
     PATCH_JUMP(exit_jump);
-    EMIT_BYTE(OP_POP);
 }
 
 STATEMENT(_return)
@@ -726,7 +839,14 @@ STATEMENT(_return)
     {
         expression(c);
         consume(c, TOKEN_SEMICOLON);
-        EMIT_BYTE(OP_RETURN);
+
+        // "return f(...);" reuses the frame of the function returning
+        int start = fusable_from(c, 1);
+        if (start != -1 && LAST_OP(0) == OP_CALL)
+        {
+            c->fn->chunk.code[start] = OP_TAIL_CALL;
+        }
+        EMIT_OP(OP_RETURN);
     }
 }
 
@@ -735,7 +855,16 @@ expression_statement(Compiler *c)
 {
     expression(c);
     consume(c, TOKEN_SEMICOLON);
-    EMIT_BYTE(OP_POP);
+
+    // "x = ...;" assigning a local doesn't need to leave the value around
+    int start = fusable_from(c, 1);
+    if (start != -1 && LAST_OP(0) == OP_SET_LOCAL)
+    {
+        c->fn->chunk.code[start] = OP_SET_LOCAL_POP;
+        return;
+    }
+
+    EMIT_OP(OP_POP);
 }
 
 static void
@@ -817,15 +946,20 @@ definition(Compiler *c)
 static Compiler *
 Compiler_init(Parser *p, Compiler *parent, FunctionType type)
 {
-    Compiler *c    = calloc(1, sizeof(struct compiler_t));
+    Compiler *c    = QxlArena_New(p->arena, Compiler);
     c->parent      = parent;
     c->p           = p;
     c->fn          = NULL;
     c->type        = type;
     c->scope_depth = 0;
     c->local_count = 0;
+    c->ops[0] = c->ops[1] = c->ops[2] = -1;
+    c->jump_target = 0;
 
-    c->fn = QxlFunction_new(p->vm);
+    // Registered first so that running out of memory below can find the
+    // arena, marking the compilers skips the function until it exists
+    p->vm->compiler = c;
+    c->fn           = QxlFunction_new(p->vm);
 
     if (type != TYPE_MAIN)
     {
@@ -845,6 +979,13 @@ Compiler_end(Compiler *c)
 {
     EMIT_RETURN();
     QxlFunction *fn = c->fn;
+    fn->max_stack   = QxlChunk_max_depth(&fn->chunk, fn->arity + 1);
+
+    if (c->p->vm->register_mode && !c->p->had_error &&
+        !QxlChunk_to_registers(&fn->chunk, fn->arity + 1, &fn->max_stack))
+    {
+        PARSER_ERROR("function is too large for register mode");
+    }
 
 #ifdef DEBUG_TRACE_COMPILING_CHUNK
     if (!c->p->had_error)
@@ -854,19 +995,23 @@ Compiler_end(Compiler *c)
     }
 #endif
 
-    // [TODO] : Rest compiler to parent
-    // This is not working for some reason
-    // c = c->parent;
+    c->p->vm->compiler = c->parent;
     return fn;
 }
 
 QxlFunction *
 compile(const char *src, VM *vm)
 {
-    Parser *p = &(Parser){.s          = scanner_init(src),
+    QxlArena arena;
+    QxlArena_init(&arena);
+    Scanner *s = QxlArena_New(&arena, Scanner);
+    scanner_init(s, src);
+
+    Parser *p = &(Parser){.s          = s,
                           .had_error  = false,
                           .panic_mode = false,
-                          .vm         = vm};
+                          .vm         = vm,
+                          .arena      = &arena};
 
     Compiler *c = Compiler_init(p, NULL, TYPE_MAIN);
 
@@ -878,5 +1023,16 @@ compile(const char *src, VM *vm)
     }
 
     QxlFunction *fn = Compiler_end(c);
-    return c->p->had_error ? NULL : fn;
-}
\ No newline at end of file
+    bool had_error  = p->had_error;
+    QxlArena_free(&arena);
+    return had_error ? NULL : fn;
+}
+
+void
+compiler_mark_roots(VM *vm)
+{
+    for (Compiler *c = vm->compiler; c != NULL; c = c->parent)
+    {
+        QxlMem_mark_object(vm, (QxlObject *)c->fn);
+    }
+}
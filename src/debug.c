@@ -1,4 +1,5 @@
 #include "include/debug.h"
+#include "include/memory.h"
 #include "include/scanner.h"
 #include "include/value.h"
 
@@ -30,6 +31,15 @@ byte_instruction(const char *name, QxlChunk *chunk, int offset)
     return offset + 2;
 }
 
+static int
+global_instruction(const char *name, QxlChunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int
 jump_instruction(const char *name, int sign, QxlChunk *chunk, int offset)
 {
@@ -39,6 +49,75 @@ jump_instruction(const char *name, int sign, QxlChunk *chunk, int offset)
     return offset + 3;
 }
 
+static int
+two_byte_instruction(const char *name, QxlChunk *chunk, int offset)
+{
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1],
+           chunk->code[offset + 2]);
+    return offset + 3;
+}
+
+static int
+local_constant_jump_instruction(const char *name, QxlChunk *chunk, int offset)
+{
+    uint8_t slot     = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    uint16_t jump    = (uint16_t)(chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    QxlValue_print(chunk->constants.values[constant]);
+    printf("' -> %d\n", offset + 5 + jump);
+    return offset + 5;
+}
+
+static int
+register_instruction(const char *name, int operands, QxlChunk *chunk,
+                     int offset)
+{
+    printf("%-16s", name);
+    for (int i = 1; i <= operands; i++)
+    {
+        printf(" %4d", chunk->code[offset + i]);
+    }
+    printf("\n");
+    return offset + 1 + operands;
+}
+
+static int
+register_constant_instruction(const char *name, QxlChunk *chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+    QxlValue_print(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int
+register_global_instruction(const char *name, QxlChunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 2] << 8);
+    slot |= chunk->code[offset + 3];
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], slot);
+    return offset + 4;
+}
+
+static int
+register_jump_instruction(const char *name, int operands, int sign,
+                          QxlChunk *chunk, int offset)
+{
+    printf("%-16s", name);
+    for (int i = 1; i <= operands; i++)
+    {
+        printf(" %4d", chunk->code[offset + i]);
+    }
+    int end       = offset + operands + 3;
+    uint16_t jump = (uint16_t)(chunk->code[end - 2] << 8);
+    jump |= chunk->code[end - 1];
+    printf(" -> %d\n", end + sign * jump);
+    return end;
+}
+
 int
 debug_disassemble_instruction(QxlChunk *chunk, int offset)
 {
@@ -59,11 +138,11 @@ debug_disassemble_instruction(QxlChunk *chunk, int offset)
     case OP_CONSTANT:
         return constant_instruction("OP_CONSTANT", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+        return global_instruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        return global_instruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
         return byte_instruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -76,6 +155,21 @@ debug_disassemble_instruction(QxlChunk *chunk, int offset)
         return jump_instruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byte_instruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byte_instruction("OP_TAIL_CALL", chunk, offset);
+    case OP_CALL_BUILTIN:
+        return byte_instruction("OP_CALL_BUILTIN", chunk, offset);
+    case OP_BUILD_STRING:
+        return byte_instruction("OP_BUILD_STRING", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_ADD_LOCALS:
+        return two_byte_instruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_LESS_LOCAL_CONST_JUMP:
+        return local_constant_jump_instruction("OP_LESS_LOCAL_CONST_JUMP",
+                                               chunk, offset);
     case OP_NIL:
         SI("OP_NIL");
     case OP_TRUE:
@@ -98,14 +192,97 @@ debug_disassemble_instruction(QxlChunk *chunk, int offset)
         SI("OP_GREATER");
     case OP_LESS:
         SI("OP_LESS");
+    case OP_NOT_EQUAL:
+        SI("OP_NOT_EQUAL");
+    case OP_GREATER_EQUAL:
+        SI("OP_GREATER_EQUAL");
+    case OP_LESS_EQUAL:
+        SI("OP_LESS_EQUAL");
     case OP_NEGATE:
         SI("OP_NEGATE");
+    case OP_ADD_NUMBER:
+        SI("OP_ADD_NUMBER");
+    case OP_SUBTRACT_NUMBER:
+        SI("OP_SUBTRACT_NUMBER");
+    case OP_GREATER_NUMBER:
+        SI("OP_GREATER_NUMBER");
+    case OP_LESS_NUMBER:
+        SI("OP_LESS_NUMBER");
+    case OP_GREATER_EQUAL_NUMBER:
+        SI("OP_GREATER_EQUAL_NUMBER");
+    case OP_LESS_EQUAL_NUMBER:
+        SI("OP_LESS_EQUAL_NUMBER");
     case OP_PRINT:
         SI("OP_PRINT");
     case OP_POP:
         SI("OP_POP");
+    case OP_DUP:
+        SI("OP_DUP");
     case OP_RETURN:
         SI("OP_RETURN");
+    case OP_R_MOVE:
+        return register_instruction("OP_R_MOVE", 2, chunk, offset);
+    case OP_R_LOADK:
+        return register_constant_instruction("OP_R_LOADK", chunk, offset);
+    case OP_R_NIL:
+        return register_instruction("OP_R_NIL", 1, chunk, offset);
+    case OP_R_TRUE:
+        return register_instruction("OP_R_TRUE", 1, chunk, offset);
+    case OP_R_FALSE:
+        return register_instruction("OP_R_FALSE", 1, chunk, offset);
+    case OP_R_ADD:
+        return register_instruction("OP_R_ADD", 3, chunk, offset);
+    case OP_R_SUBTRACT:
+        return register_instruction("OP_R_SUBTRACT", 3, chunk, offset);
+    case OP_R_MULTIPLY:
+        return register_instruction("OP_R_MULTIPLY", 3, chunk, offset);
+    case OP_R_DIVIDE:
+        return register_instruction("OP_R_DIVIDE", 3, chunk, offset);
+    case OP_R_EQUAL:
+        return register_instruction("OP_R_EQUAL", 3, chunk, offset);
+    case OP_R_NOT_EQUAL:
+        return register_instruction("OP_R_NOT_EQUAL", 3, chunk, offset);
+    case OP_R_GREATER:
+        return register_instruction("OP_R_GREATER", 3, chunk, offset);
+    case OP_R_GREATER_EQUAL:
+        return register_instruction("OP_R_GREATER_EQUAL", 3, chunk, offset);
+    case OP_R_LESS:
+        return register_instruction("OP_R_LESS", 3, chunk, offset);
+    case OP_R_LESS_EQUAL:
+        return register_instruction("OP_R_LESS_EQUAL", 3, chunk, offset);
+    case OP_R_NOT:
+        return register_instruction("OP_R_NOT", 2, chunk, offset);
+    case OP_R_NEGATE:
+        return register_instruction("OP_R_NEGATE", 2, chunk, offset);
+    case OP_R_PRINT:
+        return register_instruction("OP_R_PRINT", 1, chunk, offset);
+    case OP_R_DEFINE_GLOBAL:
+        return register_global_instruction("OP_R_DEFINE_GLOBAL", chunk, offset);
+    case OP_R_GET_GLOBAL:
+        return register_global_instruction("OP_R_GET_GLOBAL", chunk, offset);
+    case OP_R_SET_GLOBAL:
+        return register_global_instruction("OP_R_SET_GLOBAL", chunk, offset);
+    case OP_R_JUMP:
+        return register_jump_instruction("OP_R_JUMP", 0, 1, chunk, offset);
+    case OP_R_JUMP_IF_FALSE:
+        return register_jump_instruction("OP_R_JUMP_IF_FALSE", 1, 1, chunk,
+                                         offset);
+    case OP_R_JUMP_IF_NOT_LESS:
+        return register_jump_instruction("OP_R_JUMP_IF_NOT_LESS", 2, 1, chunk,
+                                         offset);
+    case OP_R_JUMP_IF_NOT_LESS_K:
+        return register_jump_instruction("OP_R_JUMP_IF_NOT_LESS_K", 2, 1,
+                                         chunk, offset);
+    case OP_R_LOOP:
+        return register_jump_instruction("OP_R_LOOP", 0, -1, chunk, offset);
+    case OP_R_CALL:
+        return register_instruction("OP_R_CALL", 2, chunk, offset);
+    case OP_R_TAIL_CALL:
+        return register_instruction("OP_R_TAIL_CALL", 2, chunk, offset);
+    case OP_R_RETURN:
+        return register_instruction("OP_R_RETURN", 1, chunk, offset);
+    case OP_R_BUILD_STRING:
+        return register_instruction("OP_R_BUILD_STRING", 3, chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -176,4 +353,99 @@ debug_token(TokenType token)
     {
         printf("Unknown token\n");
     }
-}
\ No newline at end of file
+}
+
+#ifdef DEBUG_TRACK_ALLOCATIONS
+static const char *opcodes[] = {
+    [OP_CONSTANT]              = "OP_CONSTANT",
+    [OP_NEGATE]                = "OP_NEGATE",
+    [OP_NOT]                   = "OP_NOT",
+    [OP_ADD]                   = "OP_ADD",
+    [OP_SUBTRACT]              = "OP_SUBTRACT",
+    [OP_MULTIPLY]              = "OP_MULTIPLY",
+    [OP_DIVIDE]                = "OP_DIVIDE",
+    [OP_RETURN]                = "OP_RETURN",
+    [OP_NIL]                   = "OP_NIL",
+    [OP_TRUE]                  = "OP_TRUE",
+    [OP_FALSE]                 = "OP_FALSE",
+    [OP_EQUAL]                 = "OP_EQUAL",
+    [OP_GREATER]               = "OP_GREATER",
+    [OP_LESS]                  = "OP_LESS",
+    [OP_PRINT]                 = "OP_PRINT",
+    [OP_POP]                   = "OP_POP",
+    [OP_DUP]                   = "OP_DUP",
+    [OP_DEFINE_GLOBAL]         = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL]            = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL]            = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL]             = "OP_GET_LOCAL",
+    [OP_SET_LOCAL]             = "OP_SET_LOCAL",
+    [OP_JUMP]                  = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]         = "OP_JUMP_IF_FALSE",
+    [OP_LOOP]                  = "OP_LOOP",
+    [OP_CALL]                  = "OP_CALL",
+    [OP_TAIL_CALL]             = "OP_TAIL_CALL",
+    [OP_BUILD_STRING]          = "OP_BUILD_STRING",
+    [OP_NOT_EQUAL]             = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL]         = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL]            = "OP_LESS_EQUAL",
+    [OP_ADD_LOCALS]            = "OP_ADD_LOCALS",
+    [OP_SET_LOCAL_POP]         = "OP_SET_LOCAL_POP",
+    [OP_POP_JUMP_IF_FALSE]     = "OP_POP_JUMP_IF_FALSE",
+    [OP_LESS_LOCAL_CONST_JUMP] = "OP_LESS_LOCAL_CONST_JUMP",
+    [OP_ADD_NUMBER]            = "OP_ADD_NUMBER",
+    [OP_SUBTRACT_NUMBER]       = "OP_SUBTRACT_NUMBER",
+    [OP_GREATER_NUMBER]        = "OP_GREATER_NUMBER",
+    [OP_LESS_NUMBER]           = "OP_LESS_NUMBER",
+    [OP_GREATER_EQUAL_NUMBER]  = "OP_GREATER_EQUAL_NUMBER",
+    [OP_LESS_EQUAL_NUMBER]     = "OP_LESS_EQUAL_NUMBER",
+    [OP_CALL_BUILTIN]          = "OP_CALL_BUILTIN",
+    [OP_R_MOVE]                = "OP_R_MOVE",
+    [OP_R_LOADK]               = "OP_R_LOADK",
+    [OP_R_NIL]                 = "OP_R_NIL",
+    [OP_R_TRUE]                = "OP_R_TRUE",
+    [OP_R_FALSE]               = "OP_R_FALSE",
+    [OP_R_ADD]                 = "OP_R_ADD",
+    [OP_R_SUBTRACT]            = "OP_R_SUBTRACT",
+    [OP_R_MULTIPLY]            = "OP_R_MULTIPLY",
+    [OP_R_DIVIDE]              = "OP_R_DIVIDE",
+    [OP_R_EQUAL]               = "OP_R_EQUAL",
+    [OP_R_NOT_EQUAL]           = "OP_R_NOT_EQUAL",
+    [OP_R_GREATER]             = "OP_R_GREATER",
+    [OP_R_GREATER_EQUAL]       = "OP_R_GREATER_EQUAL",
+    [OP_R_LESS]                = "OP_R_LESS",
+    [OP_R_LESS_EQUAL]          = "OP_R_LESS_EQUAL",
+    [OP_R_NOT]                 = "OP_R_NOT",
+    [OP_R_NEGATE]              = "OP_R_NEGATE",
+    [OP_R_PRINT]               = "OP_R_PRINT",
+    [OP_R_DEFINE_GLOBAL]       = "OP_R_DEFINE_GLOBAL",
+    [OP_R_GET_GLOBAL]          = "OP_R_GET_GLOBAL",
+    [OP_R_SET_GLOBAL]          = "OP_R_SET_GLOBAL",
+    [OP_R_JUMP]                = "OP_R_JUMP",
+    [OP_R_JUMP_IF_FALSE]       = "OP_R_JUMP_IF_FALSE",
+    [OP_R_JUMP_IF_NOT_LESS]    = "OP_R_JUMP_IF_NOT_LESS",
+    [OP_R_JUMP_IF_NOT_LESS_K]  = "OP_R_JUMP_IF_NOT_LESS_K",
+    [OP_R_LOOP]                = "OP_R_LOOP",
+    [OP_R_CALL]                = "OP_R_CALL",
+    [OP_R_TAIL_CALL]           = "OP_R_TAIL_CALL",
+    [OP_R_RETURN]              = "OP_R_RETURN",
+    [OP_R_BUILD_STRING]        = "OP_R_BUILD_STRING",
+};
+
+void
+debug_allocations_report(void)
+{
+    fflush(stdout);
+    fprintf(stderr, "== allocations by opcode ==\n");
+    for (int op = 0; op < UINT8_COUNT; op++)
+    {
+        if (QxlMem_allocations[op] == 0) continue;
+        const char *name =
+            op < (int)(sizeof(opcodes) / sizeof(opcodes[0])) ? opcodes[op]
+                                                              : NULL;
+        fprintf(stderr, "%-26s %zu\n", name != NULL ? name : "unknown",
+                QxlMem_allocations[op]);
+    }
+    fprintf(stderr, "%-26s %zu\n", "<outside the interpreter>",
+            QxlMem_allocations[UINT8_COUNT]);
+}
+#endif
@@ -0,0 +1,392 @@
+#include "include/image.h"
+#include "include/builtins.h"
+#include "include/memory.h"
+#include "include/object.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// Every record starts on a boundary the objects could have in memory
+#define IMAGE_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+#ifdef NAN_BOXING
+#define IMAGE_NAN_BOXING 1
+#else
+#define IMAGE_NAN_BOXING 0
+#endif
+#ifdef WIDE_HASH
+#define IMAGE_WIDE_HASH 1
+#else
+#define IMAGE_WIDE_HASH 0
+#endif
+#define IMAGE_REGISTER_MODE (1u << 9)
+#define IMAGE_CONFIG(register_mode)                                            \
+    ((uint32_t)sizeof(QxlValue) | IMAGE_NAN_BOXING << 8 |                      \
+     ((register_mode) ? IMAGE_REGISTER_MODE : 0) | IMAGE_WIDE_HASH << 10)
+
+// Bytes a function takes in the image, its chunk follows it trimmed to size
+static size_t
+function_size(QxlFunction *fn)
+{
+    return IMAGE_ALIGN(sizeof(QxlFunction)) +
+           IMAGE_ALIGN(fn->chunk.count * sizeof(uint8_t)) +
+           IMAGE_ALIGN(fn->chunk.count * sizeof(int)) +
+           IMAGE_ALIGN(fn->chunk.constants.count * sizeof(QxlValue));
+}
+
+static size_t
+record_size(QxlObject *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_STRING:
+        return IMAGE_ALIGN(QxlString_Size(((QxlString *)obj)->length));
+    case OBJ_FUNCTION:
+        return function_size((QxlFunction *)obj);
+    case OBJ_BUILTIN:
+        return IMAGE_ALIGN(sizeof(QxlBuiltin));
+    case OBJ_ROPE:
+        // Written as the flat string, see write_record
+        return IMAGE_ALIGN(QxlString_Size(((QxlRope *)obj)->length));
+    }
+    return 0;
+}
+
+// Writing
+
+// While an image is written every object's `next` holds the offset of its
+// record instead, the objects are kept in order in an array meanwhile
+#define IMAGE_OFFSET(obj) ((uint64_t)(uintptr_t)((QxlObject *)(obj))->next)
+
+static void *
+image_pointer(void *obj)
+{
+    return obj != NULL ? (void *)(uintptr_t)(QXL_IMAGE_BASE + IMAGE_OFFSET(obj))
+                       : NULL;
+}
+
+static QxlValue
+image_value(QxlValue value)
+{
+    return IS_OBJECT(value)
+               ? OBJECT_VAL((QxlObject *)image_pointer(AS_OBJECT(value)))
+               : value;
+}
+
+// Pads what was written of `size` bytes up to the next record boundary
+static void
+write_padding(FILE *out, size_t size)
+{
+    static const uint8_t padding[16] = {0};
+    fwrite(padding, 1, IMAGE_ALIGN(size) - size, out);
+}
+
+static void
+write_padded(FILE *out, const void *data, size_t size)
+{
+    fwrite(data, 1, size, out);
+    write_padding(out, size);
+}
+
+static bool
+write_record(FILE *out, QxlObject *obj, uint64_t offset)
+{
+    switch (obj->type)
+    {
+    case OBJ_STRING:
+    {
+        QxlString *string  = (QxlString *)obj;
+        QxlString copy     = *string;
+        copy.obj.next      = NULL;
+        copy.obj.is_marked = true;
+        fwrite(&copy, 1, sizeof(QxlString), out);
+        fwrite(string->chars, 1, string->length + 1, out);
+        write_padding(out, QxlString_Size(string->length));
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        QxlFunction *fn    = (QxlFunction *)obj;
+        QxlChunk *chunk    = &fn->chunk;
+        QxlFunction copy   = *fn;
+        uint64_t code      = offset + IMAGE_ALIGN(sizeof(QxlFunction));
+        uint64_t lines     = code + IMAGE_ALIGN(chunk->count * sizeof(uint8_t));
+        uint64_t constants = lines + IMAGE_ALIGN(chunk->count * sizeof(int));
+
+        copy.obj.next            = NULL;
+        copy.obj.is_marked       = true;
+        copy.name                = image_pointer(fn->name);
+        copy.chunk.cap           = chunk->count;
+        copy.chunk.code  = (uint8_t *)(uintptr_t)(QXL_IMAGE_BASE + code);
+        copy.chunk.lines = (int *)(uintptr_t)(QXL_IMAGE_BASE + lines);
+        copy.chunk.constants.cap = chunk->constants.count;
+        copy.chunk.constants.values =
+            chunk->constants.count > 0
+                ? (QxlValue *)(uintptr_t)(QXL_IMAGE_BASE + constants)
+                : NULL;
+        write_padded(out, &copy, sizeof(QxlFunction));
+        write_padded(out, chunk->code, chunk->count * sizeof(uint8_t));
+        write_padded(out, chunk->lines, chunk->count * sizeof(int));
+
+        for (size_t i = 0; i < chunk->constants.count; i++)
+        {
+            QxlValue constant = image_value(chunk->constants.values[i]);
+            fwrite(&constant, 1, sizeof(QxlValue), out);
+        }
+        write_padding(out, chunk->constants.count * sizeof(QxlValue));
+        break;
+    }
+    case OBJ_BUILTIN:
+    {
+        // The definition is found again by name when the image is loaded
+        QxlBuiltin copy    = *(QxlBuiltin *)obj;
+        copy.obj.next      = NULL;
+        copy.obj.is_marked = true;
+        copy.def           = NULL;
+        copy.name          = image_pointer(copy.name);
+        write_padded(out, &copy, sizeof(QxlBuiltin));
+        break;
+    }
+    case OBJ_ROPE:
+    {
+        // Flattening would point an image object at the heap, so ropes are
+        // written as the strings they stand for
+        QxlRope *rope   = (QxlRope *)obj;
+        QxlString *copy = (QxlString *)malloc(QxlString_Size(rope->length));
+        if (copy == NULL) return false;
+        copy->obj.next      = NULL;
+        copy->obj.type      = OBJ_STRING;
+        copy->obj.is_marked = true;
+        copy->obj.line      = rope->obj.line;
+        copy->length        = rope->length;
+        copy->hash          = 0;
+        QxlString_copy_chars(obj, copy->chars);
+        copy->chars[rope->length] = '\0';
+        write_padded(out, copy, QxlString_Size(rope->length));
+        free(copy);
+        break;
+    }
+    }
+    return true;
+}
+
+bool
+QxlImage_write(VM *vm, FILE *out)
+{
+    // Everything reachable ends up old, and so on the object list
+    VM *previous = QxlMem_attach(vm);
+    QxlMem_collect_nursery(vm);
+    QxlMem_collect_garbage(vm);
+    QxlMem_attach(previous);
+
+    size_t count = 0;
+    for (QxlObject *obj = vm->objects; obj != NULL; obj = obj->next) count++;
+    QxlObject **objects = (QxlObject **)malloc(sizeof(QxlObject *) * count);
+    if (objects == NULL) return false;
+
+    uint64_t offset = IMAGE_ALIGN(sizeof(QxlImageHeader));
+    size_t i        = 0;
+    for (QxlObject *obj = vm->objects; obj != NULL; obj = obj->next)
+    {
+        objects[i++] = obj;
+    }
+    for (i = 0; i < count; i++)
+    {
+        size_t size      = record_size(objects[i]);
+        objects[i]->next = (QxlObject *)(uintptr_t)offset;
+        offset += size;
+    }
+
+    QxlImageHeader header = {
+        .magic        = QXL_IMAGE_MAGIC,
+        .version      = QXL_IMAGE_VERSION,
+        .config       = IMAGE_CONFIG(vm->register_mode),
+        .base         = QXL_IMAGE_BASE,
+        .objects      = IMAGE_ALIGN(sizeof(QxlImageHeader)),
+        .globals      = offset,
+        .global_count = vm->global_values.count,
+    };
+    header.size = offset + header.global_count * 2 * sizeof(QxlValue);
+    write_padded(out, &header, sizeof(QxlImageHeader));
+
+    bool written = true;
+    for (i = 0; i < count && written; i++)
+    {
+        written = write_record(out, objects[i], IMAGE_OFFSET(objects[i]));
+    }
+
+    for (i = 0; i < vm->global_values.count; i++)
+    {
+        QxlValue slot[2] = {image_value(vm->global_names.values[i]),
+                            image_value(vm->global_values.values[i])};
+        fwrite(slot, 1, sizeof(slot), out);
+    }
+
+    // Put the object list back together
+    for (i = 0; i < count; i++)
+    {
+        objects[i]->next = i + 1 < count ? objects[i + 1] : NULL;
+    }
+    free(objects);
+
+    fflush(out);
+    return written && !ferror(out);
+}
+
+// Loading
+
+static uint8_t *
+map_image(const char *path, QxlImageHeader *header)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    bool ok = fread(header, sizeof(QxlImageHeader), 1, file) == 1 &&
+              memcmp(header->magic, QXL_IMAGE_MAGIC, 8) == 0 &&
+              header->version == QXL_IMAGE_VERSION &&
+              (header->config & ~IMAGE_REGISTER_MODE) == IMAGE_CONFIG(false) &&
+              header->objects <= header->globals &&
+              header->globals + header->global_count * 2 * sizeof(QxlValue) ==
+                  header->size &&
+              fseek(file, 0L, SEEK_END) == 0 &&
+              (uint64_t)ftell(file) == header->size;
+    if (!ok)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    uint8_t *image = NULL;
+#ifdef _WIN32
+    // Read in whole and always relocated
+    image = (uint8_t *)malloc(header->size);
+    if (image != NULL &&
+        (fseek(file, 0L, SEEK_SET) != 0 ||
+         fread(image, 1, header->size, file) != header->size))
+    {
+        free(image);
+        image = NULL;
+    }
+#else
+    // Private pages, the code is quickened in place as it runs
+#ifdef MAP_FIXED_NOREPLACE
+    int flags = MAP_PRIVATE | MAP_FIXED_NOREPLACE;
+#else
+    int flags = MAP_PRIVATE;
+#endif
+    image = mmap((void *)(uintptr_t)header->base, header->size,
+                 PROT_READ | PROT_WRITE, flags, fileno(file), 0);
+    if (image == MAP_FAILED)
+    {
+        image = mmap(NULL, header->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fileno(file), 0);
+    }
+    if (image == MAP_FAILED) image = NULL;
+#endif
+
+    fclose(file);
+    return image;
+}
+
+#define RELOCATE(ptr, delta)                                                   \
+    ((ptr) = (ptr) != NULL ? (void *)((uint8_t *)(ptr) + (delta)) : NULL)
+
+static QxlValue
+relocate_value(QxlValue value, ptrdiff_t delta)
+{
+    return IS_OBJECT(value)
+               ? OBJECT_VAL((QxlObject *)((uint8_t *)AS_OBJECT(value) + delta))
+               : value;
+}
+
+// Points the object at where the image really is and hooks it up to the VM.
+// Nothing is written when the image got its preferred address, except for
+// the builtins.
+static bool
+load_record(VM *vm, QxlObject *obj, ptrdiff_t delta)
+{
+    switch (obj->type)
+    {
+    case OBJ_STRING:
+        // Only interned strings were hashed, the ones made while code ran
+        // stay out of the table as they were
+        if (((QxlString *)obj)->hash != 0)
+        {
+            QxlHashTable_put(&vm->strings, (QxlString *)obj, NIL_VAL);
+        }
+        return true;
+    case OBJ_FUNCTION:
+    {
+        if (delta == 0) return true;
+        QxlFunction *fn = (QxlFunction *)obj;
+        RELOCATE(fn->name, delta);
+        RELOCATE(fn->chunk.code, delta);
+        RELOCATE(fn->chunk.lines, delta);
+        RELOCATE(fn->chunk.constants.values, delta);
+        for (size_t i = 0; i < fn->chunk.constants.count; i++)
+        {
+            fn->chunk.constants.values[i] =
+                relocate_value(fn->chunk.constants.values[i], delta);
+        }
+        return true;
+    }
+    case OBJ_BUILTIN:
+    {
+        QxlBuiltin *builtin = (QxlBuiltin *)obj;
+        RELOCATE(builtin->name, delta);
+        builtin->def = builtins_find(builtin->name->chars);
+        return builtin->def != NULL;
+    }
+    case OBJ_ROPE:
+        return false;
+    }
+    return false;
+}
+
+bool
+QxlImage_load(VM *vm, const char *path)
+{
+    QxlImageHeader header;
+    uint8_t *image = map_image(path, &header);
+    if (image == NULL) return false;
+
+    vm->image         = image;
+    vm->image_size    = header.size;
+    vm->register_mode = (header.config & IMAGE_REGISTER_MODE) != 0;
+    ptrdiff_t delta   = (ptrdiff_t)((uintptr_t)image - header.base);
+
+    for (uint64_t offset = header.objects; offset < header.globals;)
+    {
+        QxlObject *obj = (QxlObject *)(image + offset);
+        if (obj->type >= OBJ_TYPE_COUNT ||
+            offset + record_size(obj) > header.globals ||
+            !load_record(vm, obj, delta))
+        {
+            return false;
+        }
+        offset += record_size(obj);
+    }
+
+    QxlValue *slots = (QxlValue *)(image + header.globals);
+    for (uint64_t i = 0; i < header.global_count; i++)
+    {
+        QxlString *name = AS_STRING(relocate_value(slots[2 * i], delta));
+        if (vm_global_slot(vm, name) != (int)i) return false;
+        vm->global_values.values[i] = relocate_value(slots[2 * i + 1], delta);
+    }
+
+    return true;
+}
+
+void
+QxlImage_unload(VM *vm)
+{
+    if (vm->image == NULL) return;
+#ifdef _WIN32
+    free(vm->image);
+#else
+    munmap(vm->image, vm->image_size);
+#endif
+    vm->image = NULL;
+}
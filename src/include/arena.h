@@ -0,0 +1,42 @@
+#ifndef Qxl_ARENA_H
+#define Qxl_ARENA_H
+
+#include "quixil.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Blocks hold QXL_ARENA_BLOCK_SIZE bytes, larger requests get a block of
+// their own
+#define QXL_ARENA_BLOCK_SIZE (64 * 1024)
+
+    typedef struct arena_block_t
+    {
+        struct arena_block_t *next;
+        size_t used;
+        size_t cap;
+        max_align_t data[];
+    } QxlArenaBlock;
+
+    // Bump allocator for scratch data that dies all at once, like everything
+    // the compiler allocates besides the functions it produces.
+    typedef struct
+    {
+        QxlArenaBlock *blocks; // newest first, allocations bump the first
+    } QxlArena;
+
+    void QxlArena_init(QxlArena *arena);
+    // Returns `size` zeroed bytes that live until the arena is freed
+    void *QxlArena_allocate(QxlArena *arena, size_t size);
+    void QxlArena_free(QxlArena *arena);
+
+#define QxlArena_New(arena, type)                                              \
+    (type *)QxlArena_allocate((arena), sizeof(type))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* Qxl_ARENA_H */
@@ -11,6 +11,8 @@ extern "C"
 #endif
 
     void builtins_init(VM *vm);
+    // Returns the builtin called `name`, or NULL if there is none
+    const QxlBuiltinDef *builtins_find(const char *name);
 
 #ifdef __cplusplus
 }
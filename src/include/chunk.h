@@ -37,7 +37,64 @@ extern "C"
         OP_JUMP,
         OP_JUMP_IF_FALSE,
         OP_LOOP,
-        OP_CALL
+        OP_CALL,
+        OP_TAIL_CALL, // OP_CALL reusing the frame, always followed by
+                      // OP_RETURN
+        OP_BUILD_STRING, // joins the top n strings and numbers, the parts
+                         // of a template string
+        // Superinstructions, fused by the compiler from the most frequent
+        // opcode sequences
+        OP_NOT_EQUAL,             // OP_EQUAL, OP_NOT
+        OP_GREATER_EQUAL,         // OP_LESS, OP_NOT
+        OP_LESS_EQUAL,            // OP_GREATER, OP_NOT
+        OP_ADD_LOCALS,            // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+        OP_SET_LOCAL_POP,         // OP_SET_LOCAL, OP_POP
+        OP_POP_JUMP_IF_FALSE,     // OP_JUMP_IF_FALSE, OP_POP on both paths
+        OP_LESS_LOCAL_CONST_JUMP, // OP_GET_LOCAL, OP_CONSTANT, OP_LESS,
+                                  // OP_POP_JUMP_IF_FALSE
+        // Quickened forms, rewritten in place by the VM once an instruction
+        // has seen the operands it is specialized for and never emitted by
+        // the compiler
+        OP_ADD_NUMBER,
+        OP_SUBTRACT_NUMBER,
+        OP_GREATER_NUMBER,
+        OP_LESS_NUMBER,
+        OP_GREATER_EQUAL_NUMBER,
+        OP_LESS_EQUAL_NUMBER,
+        OP_CALL_BUILTIN, // OP_CALL whose callee has been a builtin
+        // Register instructions, produced from the stack instructions above
+        // when compiling in register mode. Operands named a, b and c are
+        // frame slots, k is a constant index and slot a 16 bit global slot.
+        OP_R_MOVE,               // a = b
+        OP_R_LOADK,              // a = k
+        OP_R_NIL,                // a = nil
+        OP_R_TRUE,               // a = true
+        OP_R_FALSE,              // a = false
+        OP_R_ADD,                // a = b + c
+        OP_R_SUBTRACT,           // a = b - c
+        OP_R_MULTIPLY,           // a = b * c
+        OP_R_DIVIDE,             // a = b / c
+        OP_R_EQUAL,              // a = b == c
+        OP_R_NOT_EQUAL,          // a = b != c
+        OP_R_GREATER,            // a = b > c
+        OP_R_GREATER_EQUAL,      // a = b >= c
+        OP_R_LESS,               // a = b < c
+        OP_R_LESS_EQUAL,         // a = b <= c
+        OP_R_NOT,                // a = !b
+        OP_R_NEGATE,             // a = -b
+        OP_R_PRINT,              // print a
+        OP_R_DEFINE_GLOBAL,      // globals[slot] = a
+        OP_R_GET_GLOBAL,         // a = globals[slot]
+        OP_R_SET_GLOBAL,         // globals[slot] = a
+        OP_R_JUMP,               // ip += offset
+        OP_R_JUMP_IF_FALSE,      // if (!a) ip += offset
+        OP_R_JUMP_IF_NOT_LESS,   // if (!(a < b)) ip += offset
+        OP_R_JUMP_IF_NOT_LESS_K, // if (!(a < k)) ip += offset
+        OP_R_LOOP,               // ip -= offset
+        OP_R_CALL,               // a = a(a + 1, ..., a + b)
+        OP_R_TAIL_CALL,          // OP_R_CALL reusing the frame
+        OP_R_RETURN,             // return a
+        OP_R_BUILD_STRING,       // a = b .. b + c - 1 joined
     } OpCode;
 
     // Chunk represents the sequences of byte code
@@ -54,6 +111,11 @@ extern "C"
     void QxlChunk_add(QxlChunk *chunk, uint8_t byte, int line);
     int QxlChunk_add_constant(QxlChunk *chunk, QxlValue value);
     void QxlChunk_free(QxlChunk *chunk);
+    // Size in bytes of a stack instruction and its operands
+    int QxlChunk_instruction_length(uint8_t op);
+    // Deepest the stack gets while running the chunk, starting from `slots`
+    // values (the callee and its arguments)
+    int QxlChunk_max_depth(QxlChunk *chunk, int slots);
 
 #ifdef __cplusplus
 }
@@ -30,6 +30,8 @@ extern "C"
     void QxlHashTable_merge(QxlHashTable *from, QxlHashTable *to);
     bool QxlHashTable_get(QxlHashTable *t, QxlString *k, QxlValue *v);
     bool QxlHashTable_remove(QxlHashTable *t, QxlString *k);
+    // Drops the entries whose key the collector has not marked
+    void QxlHashTable_remove_unmarked(QxlHashTable *t);
     QxlString *QxlHashTable_find_string(QxlHashTable *t,
                                               const char *chars, int length,
                                               uint32_t hash);
@@ -11,12 +11,9 @@ extern "C"
     /* Remember to free the string after using */
     char *Qxl_fstr(const char *format, ...);
 
-    /* Hash strings using FNV-1a algorithim */
+    /* Hash strings using wyhash, or FNV-1a with -DQxl_FNV_HASH */
     uint32_t Qxl_hash_str(const char *key, int length);
 
-    /* Convert a double to string */
-    char *Qxl_num_as_str(int value);
-
 #ifdef __cplusplus
 }
 #endif
@@ -1,6 +1,7 @@
 #ifndef Qxl_COMPILER_H
 #define Qxl_COMPILER_H
 
+#include "arena.h"
 #include "chunk.h"
 #include "object.h"
 #include "scanner.h"
@@ -22,6 +23,9 @@ extern "C"
         // Parsers needs access to the vm's strings table to perform string
         // interning.
         VM *vm;
+
+        // Scratch memory of the compilation, freed when compile() returns
+        QxlArena *arena;
     } Parser;
 
     typedef enum
@@ -61,6 +65,8 @@ extern "C"
         Local locals[UINT8_COUNT];
         int local_count;
         int scope_depth;
+        int ops[3];      // offsets of the last instructions, newest first
+        int jump_target; // furthest offset a patched jump lands on
         Parser *p;
         struct compiler_t *parent;
     } Compiler;
@@ -76,6 +82,10 @@ extern "C"
 
     QxlFunction *compile(const char *src, VM *vm);
 
+    // Marks the functions still being compiled, they are not reachable from
+    // anywhere else until their compiler ends.
+    void compiler_mark_roots(VM *vm);
+
 #ifdef __cplusplus
 }
 #endif
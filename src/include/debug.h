@@ -23,6 +23,11 @@ extern "C"
     void debug_disassemble_chunk(QxlChunk *chunk, const char *name);
     void debug_token(TokenType type);
 
+#ifdef DEBUG_TRACK_ALLOCATIONS
+    // Prints how many allocations each opcode made, registered with atexit
+    void debug_allocations_report(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,48 @@
+#ifndef Qxl_IMAGE_H
+#define Qxl_IMAGE_H
+
+#include "quixil.h"
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// A startup image holds the interned strings, functions and builtins of an
+// initialized VM along with its global slots, laid out as the objects are in
+// memory. It is mapped back in at QXL_IMAGE_BASE when that range is free and
+// relocated otherwise. The objects of an image are permanently marked and on
+// no object list, so the collector never follows or frees them.
+#define QXL_IMAGE_MAGIC "QXLIMAGE"
+#define QXL_IMAGE_VERSION 3
+#ifndef QXL_IMAGE_BASE
+#define QXL_IMAGE_BASE 0x500000000000ull
+#endif
+
+    typedef struct
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t config; // value layout, string hash and interpreter
+        uint64_t base;   // address the pointers in the image assume
+        uint64_t size;   // of the whole file
+        uint64_t objects; // offset of the first object
+        uint64_t globals; // offset of the name and value of every slot
+        uint64_t global_count;
+    } QxlImageHeader;
+
+    // Collects garbage and writes everything left on the heap and the global
+    // slots to `out`. Only valid between runs, while no code is executing.
+    bool QxlImage_write(VM *vm, FILE *out);
+    // Maps the image at `path` into a VM that has no globals yet. Returns
+    // false when the file is not an image this build can use, the VM is then
+    // only fit for vm_free.
+    bool QxlImage_load(VM *vm, const char *path);
+    void QxlImage_unload(VM *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* Qxl_IMAGE_H */
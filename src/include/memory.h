@@ -15,7 +15,7 @@ extern "C"
     ((n) < QXL_DEFAULT_MEM_SIZE ? QXL_DEFAULT_MEM_SIZE : (n)*2)
 
 #define QxlMem_Allocate(type, count)                                           \
-    (type *)QxlMem_reallocate(NULL, 0, sizeof(type) * count)
+    (type *)QxlMem_reallocate(NULL, 0, sizeof(type) * (count))
 
 #define QxlMem_Realloc(type, ptr, size, new_size)                              \
     ((type *)QxlMem_reallocate((ptr), sizeof(type) * (size),                   \
@@ -28,8 +28,52 @@ extern "C"
 
     void *QxlMem_reallocate(void *ptr, size_t size, size_t new_size);
 
+    // Reserves `size` bytes of address space followed by an inaccessible
+    // guard page. Memory is committed lazily as the pages are first touched.
+    void *QxlMem_reserve(size_t size);
+    void QxlMem_release(void *ptr, size_t size);
+    // Gives the whole pages inside the range back to the OS. They stay
+    // mapped and read as zeroes, or as garbage on Windows, when touched again.
+    void QxlMem_discard(void *ptr, size_t size);
+    // Asks for the range to be backed by transparent huge pages, where the
+    // OS supports it
+    void QxlMem_advise_huge_pages(void *ptr, size_t size);
+
     void *QxlMem_free_objects(VM *vm);
 
+    // Makes `vm` the heap QxlMem_reallocate accounts to and collects, or
+    // detaches the current one when NULL. Returns the one it replaces, which
+    // is attached again when the call into `vm` returns.
+    VM *QxlMem_attach(VM *vm);
+    void QxlMem_mark_value(VM *vm, QxlValue value);
+    void QxlMem_mark_object(VM *vm, QxlObject *obj);
+    void QxlMem_collect_garbage(VM *vm);
+
+    // Records that a global slot now holds a young object
+    void QxlMem_remember_global(VM *vm, int slot);
+    // Moves the reachable nursery strings to the old space and empties the
+    // nursery. Only called at safe points of the interpreter loops, where no
+    // object pointer is held outside of the stack and the globals.
+    void QxlMem_collect_nursery(VM *vm);
+
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+    // Instruction the interpreter is executing, allocations are charged to
+    // its source line
+    extern const uint8_t *QxlMem_current_ip;
+    void QxlMem_sample_allocation(VM *vm, size_t size);
+#endif
+
+#ifdef DEBUG_TRACK_ALLOCATIONS
+    // Opcode the interpreter is executing, or -1 while compiling and outside
+    // of the interpreter loop. Allocations are counted per opcode with the
+    // ones made outside in the last entry.
+    extern int QxlMem_current_op;
+    extern size_t QxlMem_allocations[UINT8_COUNT + 1];
+    // Charges one allocation to QxlMem_current_op. Called for every growth
+    // through QxlMem_reallocate and every string bumped into the nursery.
+    void QxlMem_count_allocation(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,28 @@
+#ifndef Qxl_NUMBER_H
+#define Qxl_NUMBER_H
+
+#include "quixil.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Longest text Qxl_num_format writes, a sign with "0.00000" and 17 digits
+#define QXL_NUM_CHARS_MAX 25
+
+    /* Write the shortest text that reads back as `value` to `dest`, which has
+     * room for QXL_NUM_CHARS_MAX chars. Integers below 1e21 are written in
+     * full, numbers from 1e-6 with a decimal point and the others with an
+     * exponent, as in "1e+21" or "2.5e-7". Returns the length, no terminator
+     * is written. */
+    int Qxl_num_format(char *dest, double value);
+
+    /* Convert a double to string. Remember to free the string after using */
+    char *Qxl_num_as_str(double value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* Qxl_NUMBER_H */
@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 #include "collections.h"
+#include "common.h"
 #include "quixil.h"
 #include "value.h"
 
@@ -18,48 +19,100 @@ extern "C"
 #define IS_STRING(value) is_object_type(value, OBJ_STRING)
 #define IS_FUNCTION(value) is_object_type(value, OBJ_FUNCTION)
 #define IS_BUILTIN(value) is_object_type(value, OBJ_BUILTIN)
+#define IS_ROPE(value) is_object_type(value, OBJ_ROPE)
+// Strings are either flat or ropes, only flat ones have their chars at hand
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 #define AS_STRING(value) ((QxlString *)AS_OBJECT(value))
 #define AS_CSTRING(value) (((QxlString *)AS_OBJECT(value))->chars)
 #define AS_FUNCTION(value) ((QxlFunction *)AS_OBJECT(value))
 #define AS_BUILTIN(value) ((QxlBuiltin *)AS_OBJECT(value))
-#define AS_BUILTIN_FUNCTION(value) (((QxlBuiltin *)AS_OBJECT(value))->fn)
+#define AS_ROPE(value) ((QxlRope *)AS_OBJECT(value))
+
+#define BUILTIN_MAX_ARGS 4
 
     typedef enum
     {
         OBJ_STRING,
         OBJ_FUNCTION,
-        OBJ_BUILTIN
+        OBJ_BUILTIN,
+        OBJ_ROPE
     } QxlObjectType;
 
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
+    // Names of the object types as the user sees them, by QxlObjectType
+    extern const char *QxlObject_type_names[];
+
     struct QxlObject
     {
-        QxlObjectType type;
         struct QxlObject *next;
-        char *obj_name;
+        uint8_t type; // QxlObjectType
+        bool is_marked;
+        uint32_t line; // source line that allocated it, 0 outside of code
     };
 
+    // The chars are allocated together with the string and NUL-terminated
     struct QxlString
     {
         QxlObject obj;
         int length;
-        char *chars;
-        uint32_t hash;
+        uint32_t hash; // 0 until worked out, see QxlString_hash
+        char chars[];
     };
 
+#define QxlString_Size(length) (sizeof(QxlString) + (length) + 1)
+
+// Concatenations at least this long make a rope instead of copying both sides
+#define QXL_ROPE_MIN 256
+
+    // The concatenation of two strings or ropes, copied out into `flat` only
+    // once its chars are needed. Ropes are always old, so are their sides,
+    // and flattening lets go of the sides.
+    typedef struct
+    {
+        QxlObject obj;
+        int length;
+        QxlObject *left; // NULL once flattened
+        QxlObject *right;
+        QxlString *flat; // NULL until flattened
+    } QxlRope;
+
     typedef struct
     {
         QxlObject obj;
         int arity;
+        int max_stack; // deepest the stack gets, or registers in register mode
         QxlChunk chunk;
         QxlString *name;
     } QxlFunction;
 
-    typedef bool (*BuiltinFn)(VM *vm, int arg_count, QxlValue *args);
+    // A builtin returns its result directly. To fail it stores a static
+    // message in vm->builtin_error and returns UNDEFINED_VAL.
+    typedef QxlValue (*BuiltinFn)(VM *vm, int arg_count, QxlValue *args);
+
+    typedef enum
+    {
+        ARG_ANY,
+        ARG_NUMBER,
+        ARG_STRING,
+        ARG_BOOL
+    } QxlArgType;
 
+    // Signature of a builtin, the VM checks the arguments against it before
+    // the call so the builtin itself can trust them.
     typedef struct
     {
-        QxlObject obj;
+        const char *name;
         BuiltinFn fn;
+        int min_arity;
+        int arity;
+        QxlArgType types[BUILTIN_MAX_ARGS];
+    } QxlBuiltinDef;
+
+    typedef struct
+    {
+        QxlObject obj;
+        const QxlBuiltinDef *def;
         QxlString *name;
     } QxlBuiltin;
 
@@ -69,13 +122,49 @@ extern "C"
         return IS_OBJECT(value) && AS_OBJECT(value)->type == type;
     }
 
+    // Strings made while code runs are hashed the first time a hash table
+    // needs it. One whose chars really hash to 0 is hashed every time.
+    static inline uint32_t
+    QxlString_hash(QxlString *string)
+    {
+        if (string->hash == 0)
+        {
+            string->hash = Qxl_hash_str(string->chars, string->length);
+        }
+        return string->hash;
+    }
+
     void QxlObject_print(QxlValue value);
+    // Returns the interned string of the chars, for names and constants
     QxlString *QxlString_copy(VM *vm, const char *chars, int length);
-    QxlString *QxlString_take(VM *vm, char *chars, int length);
+    // Copies the chars into a new string that is neither hashed nor interned,
+    // for strings made while code runs
+    QxlString *QxlString_new(VM *vm, const char *chars, int length);
     QxlString *QxlString_concatenate(VM *vm, QxlString *a, QxlString *b);
     QxlString *QxlString_repeat(VM *vm, QxlString *s, int count);
+    // The text of a number, shared for small integers
+    QxlString *QxlString_from_number(VM *vm, double value);
+    // Formats `count` strings, ropes and numbers, `length` chars in all,
+    // into one string. The parts have to be reachable, this can collect.
+    QxlString *QxlString_build(VM *vm, QxlValue *parts, int count,
+                               int length);
+    // Length of a string or a rope
+    int QxlString_length(QxlObject *string);
+    // Concatenates two strings or ropes, making a rope when the result is
+    // long. Returns NULL when it would be longer than INT_MAX.
+    QxlObject *QxlString_join(VM *vm, QxlObject *a, QxlObject *b);
+    // Returns a string or a rope as a flat string, flattening a rope the
+    // first time. The rope has to be reachable, this can collect.
+    QxlString *QxlString_flatten(VM *vm, QxlObject *string);
+    // Compares two strings or ropes by their chars
+    bool QxlString_equals(QxlObject *a, QxlObject *b);
+    // Copies the chars of a string or rope to `dest`, without a terminator
+    void QxlString_copy_chars(QxlObject *string, char *dest);
+    // Copies a young string to the old space
+    QxlString *QxlString_promote(VM *vm, QxlString *young);
     QxlFunction *QxlFunction_new(VM *vm);
-    QxlBuiltin *QxlBuiltin_new(VM *vm, QxlString *name, BuiltinFn fn);
+    QxlBuiltin *QxlBuiltin_new(VM *vm, QxlString *name,
+                               const QxlBuiltinDef *def);
 
 #ifdef __cplusplus
 }
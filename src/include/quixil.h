@@ -1,6 +1,7 @@
 #ifndef Qxl_QUIXIL_H
 #define Qxl_QUIXIL_H
 
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -20,10 +21,39 @@
 #ifdef __cplusplus
 extern "C"
 {
+#endif
+
+    // Values are NaN-boxed into 8 bytes unless the build opts out with
+    // -DQxl_NO_NAN_BOXING, which falls back to a tagged union.
+#ifndef Qxl_NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+    // The interpreter loop uses labels-as-values for direct threaded dispatch
+    // when the compiler supports them, -DQxl_NO_COMPUTED_GOTO forces the
+    // portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(Qxl_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+    // Small blocks come from per-VM size-class slabs, -DQxl_NO_SLAB_ALLOCATOR
+    // sends every allocation to malloc to compare against.
+#ifndef Qxl_NO_SLAB_ALLOCATOR
+#define SLAB_ALLOCATOR
+#endif
+
+    // Strings are hashed 8 and 16 bytes at a time, -DQxl_FNV_HASH keeps the
+    // byte at a time FNV-1a to compare against. Startup images record which
+    // one hashed their strings.
+#ifndef Qxl_FNV_HASH
+#define WIDE_HASH
 #endif
 
     // #define DEBUG_TRACE_EXECUTION
     // #define DEBUG_TRACE_COMPILING_CHUNK
+    // #define DEBUG_TRACK_ALLOCATIONS
+    // #define DEBUG_SAMPLE_ALLOCATIONS
+    // #define DEBUG_STRESS_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
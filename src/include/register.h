@@ -0,0 +1,29 @@
+/*
+  Register translation. Turns the stack instructions emitted by the compiler
+  into the three-address OP_R_* instructions run by the register loop of the
+  VM. Operands address `frame->slots` directly, a stack instruction that would
+  leave its result at depth `d` writes register `d` instead, and local reads
+  are folded into the operands of the instructions that consume them.
+*/
+
+#ifndef Qxl_REGISTER_H
+#define Qxl_REGISTER_H
+
+#include "chunk.h"
+#include "quixil.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // Rewrites `chunk` in place. `slots` is the number of slots in use when
+    // the function starts (the callee and its parameters). On success the
+    // number of registers the function needs is stored in `max_stack`.
+    bool QxlChunk_to_registers(QxlChunk *chunk, int slots, int *max_stack);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* Qxl_REGISTER_H */
@@ -80,7 +80,7 @@ extern "C"
         int line;
     } Token;
 
-    Scanner *scanner_init(const char *src);
+    void scanner_init(Scanner *s, const char *src);
     Token scanner_scan_token(Scanner *s);
 
 #ifdef __cplusplus
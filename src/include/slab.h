@@ -0,0 +1,77 @@
+#ifndef Qxl_SLAB_H
+#define Qxl_SLAB_H
+
+#include "quixil.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Blocks of up to QXL_SLAB_MAX bytes are rounded up to a multiple of
+// QXL_SLAB_GRANULE. Each page of QXL_SLAB_PAGE_SIZE bytes holds blocks of one
+// size class and keeps a free list of the blocks given back to it.
+#define QXL_SLAB_GRANULE 16
+#define QXL_SLAB_MAX 256
+#define QXL_SLAB_CLASSES (QXL_SLAB_MAX / QXL_SLAB_GRANULE)
+#define QXL_SLAB_PAGE_SIZE (64 * 1024)
+
+// Pages are carved out of regions of address space reserved with mmap,
+// QXL_SLAB_REGION_SIZE bytes at a time unless the VM asks for more. Memory is
+// only committed as the pages are touched.
+#define QXL_SLAB_REGION_SIZE (4 * 1024 * 1024)
+#define QXL_SLAB_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Pages left without live blocks are kept for reuse up to this many, the
+// others are given back to the OS
+#define QXL_SLAB_EMPTY_MAX 4
+
+#define QxlSlab_fits(size) ((size) > 0 && (size) <= QXL_SLAB_MAX)
+
+    typedef struct slab_block_t
+    {
+        struct slab_block_t *next;
+    } QxlSlabBlock;
+
+    // Header at the start of every page
+    typedef struct slab_page_t
+    {
+        struct slab_page_t *next; // in the partial or empty list of its slabs
+        struct slab_page_t *prev;
+        QxlSlabBlock *free;
+        uint32_t bump; // offset of the first block never handed out
+        uint16_t live;
+        uint16_t size_class;
+    } QxlSlabPage;
+
+    typedef struct
+    {
+        QxlSlabPage *partial[QXL_SLAB_CLASSES]; // pages with a free block
+        QxlSlabPage *empty;     // pages without live blocks, still backed
+        QxlSlabPage *discarded; // pages given back to the OS, reusable
+        int empty_count;
+
+        size_t region_size;
+        bool huge_pages; // advise transparent huge pages for the regions
+        uint8_t *bump;   // pages of the newest region not handed out yet
+        uint8_t *bump_end;
+        uint8_t **regions; // every region, released with the slabs
+        int region_count;
+
+        size_t pages_discarded; // since the slabs were made
+    } QxlSlabs;
+
+    // `region_size` may be 0 for QXL_SLAB_REGION_SIZE
+    void QxlSlab_init(QxlSlabs *s, size_t region_size, bool huge_pages);
+    void QxlSlab_release(QxlSlabs *s);
+    // Same contract as realloc for blocks where `size` or `new_size` fits a
+    // size class, the other side goes to the system allocator. Returns NULL
+    // and leaves `ptr` alone when out of memory.
+    void *QxlSlab_reallocate(QxlSlabs *s, void *ptr, size_t size,
+                             size_t new_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* Qxl_SLAB_H */
@@ -0,0 +1,36 @@
+#ifndef Qxl_SNAPSHOT_H
+#define Qxl_SNAPSHOT_H
+
+#include "quixil.h"
+#include "vm.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// A heap snapshot is text with one record per line, after a header line:
+//
+//   quixil-heap-snapshot 1
+//   root <stack|frame|global> <slot or name> <id>
+//   object <id> <type> <bytes> <line> <ids of the objects it references>...
+//
+// Ids are only meaningful within one snapshot. The bytes of a function
+// include its chunk and the line is where the object was allocated, 0 for
+// objects made outside of running code.
+// Objects mapped from a startup image never change and are left out.
+#define QXL_SNAPSHOT_HEADER "quixil-heap-snapshot 1"
+
+    // Collects garbage and writes every object left reachable to `out` as it
+    // walks the heap. Returns false if writing failed.
+    bool QxlSnapshot_write(VM *vm, FILE *out);
+    // Prints the growth from snapshot file `before` to `after`, by object
+    // type and by allocation line. Returns false when either file cannot be
+    // read.
+    bool QxlSnapshot_diff(const char *before, const char *after, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* Qxl_SNAPSHOT_H */
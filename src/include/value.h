@@ -11,12 +11,68 @@ extern "C"
     typedef struct QxlObject QxlObject;
     typedef struct QxlString QxlString;
 
+#ifdef NAN_BOXING
+
+/*
+  NaN-boxed values. Every non-number is stored inside the unused payload of a
+  quiet NaN: nil, false and true get small tags in the low bits while objects
+  keep their pointer in the low 48 bits and set the sign bit. Any bit pattern
+  that is not a quiet NaN with those bits set is a plain double.
+*/
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+    typedef uint64_t QxlValue;
+
+#define FALSE_VAL ((QxlValue)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((QxlValue)(uint64_t)(QNAN | TAG_TRUE))
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((QxlValue)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((QxlValue)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) Qxl_num_to_value(num)
+#define OBJECT_VAL(object)                                                     \
+    (QxlValue)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) Qxl_value_to_num(value)
+#define AS_OBJECT(value)                                                       \
+    ((QxlObject *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_OBJECT(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+    static inline double
+    Qxl_value_to_num(QxlValue value)
+    {
+        double num;
+        memcpy(&num, &value, sizeof(QxlValue));
+        return num;
+    }
+
+    static inline QxlValue
+    Qxl_num_to_value(double num)
+    {
+        QxlValue value;
+        memcpy(&value, &num, sizeof(double));
+        return value;
+    }
+
+#else
+
     typedef enum
     {
         VAL_BOOL,
         VAL_NIL,
         VAL_NUMBER,
         VAL_OBJECT,
+        VAL_UNDEFINED,
     } QxlValueType;
 
     typedef struct
@@ -28,31 +84,36 @@ extern "C"
             double number;
             QxlObject *obj;
         } as;
-        char *type_name;
     } QxlValue;
 
-    typedef struct
-    {
-        size_t count;     // in use
-        size_t cap;       // allocated elements
-        QxlValue *values; // constant values
-    } QxlValueList;
-
-#define BOOL_VAL(value) ((QxlValue){VAL_BOOL, {.boolean = value}, "bool"})
-#define NIL_VAL ((QxlValue){VAL_NIL, {.number = 0}, "nil"})
-#define NUMBER_VAL(value) ((QxlValue){VAL_NUMBER, {.number = value}, "number"})
+#define BOOL_VAL(value) ((QxlValue){VAL_BOOL, {.boolean = value}})
+#define NIL_VAL ((QxlValue){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((QxlValue){VAL_UNDEFINED, {.number = 0}})
+#define NUMBER_VAL(value) ((QxlValue){VAL_NUMBER, {.number = value}})
 #define OBJECT_VAL(object)                                                     \
-    ((QxlValue){VAL_OBJECT, {.obj = (QxlObject *)object}, "object"})
+    ((QxlValue){VAL_OBJECT, {.obj = (QxlObject *)object}})
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_OBJECT(value) ((value).as.obj)
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJECT(value) ((value).type == VAL_OBJECT)
 
-#define Qxl_TYPE_NAME(value)                                                   \
-    (IS_OBJECT(value) ? AS_OBJECT(value)->obj_name : (value).type_name)
+#endif /* NAN_BOXING */
+
+    // UNDEFINED_VAL is never seen by scripts, it fills the slot of a global
+    // that has been referenced but not defined yet.
+
+    typedef struct
+    {
+        size_t count;     // in use
+        size_t cap;       // allocated elements
+        QxlValue *values; // constant values
+    } QxlValueList;
+
+#define Qxl_TYPE_NAME(value) QxlValue_type_name(value)
 
     void QxlValueList_init(QxlValueList *list);
     void QxlValueList_push(QxlValueList *list, QxlValue value);
@@ -60,6 +121,7 @@ extern "C"
 
     void QxlValue_print(QxlValue value);
     bool QxlValue_are_equal(QxlValue a, QxlValue b);
+    const char *QxlValue_type_name(QxlValue value);
 
 #ifdef __cplusplus
 }
@@ -5,14 +5,49 @@
 #include "collections.h"
 #include "object.h"
 #include "quixil.h"
+#include "slab.h"
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-#define VM_FRAMES_MAX 64
-#define VM_STACK_MAX (VM_FRAMES_MAX * UINT8_COUNT)
+// The stack reserves room for VM_STACK_MAX values but only the pages in use
+// are backed by memory, a guard page after it catches any overrun. Frames
+// start with room for VM_FRAMES_INIT calls and grow as needed.
+#define VM_STACK_MAX (1024 * 1024)
+#define VM_FRAMES_INIT 8
+
+// Values that may be pushed above the maximum depth of a function: the
+// operands helpers like add_values push before working on them.
+#define VM_STACK_SLACK 4
+
+// Calls shown in the traceback of a runtime error
+#define VM_TRACEBACK_MAX 32
+
+// The first collection happens once VM_GC_INITIAL bytes are allocated, the
+// next ones once the heap has grown VM_GC_GROW_FACTOR times over what survived
+// the last one, but never below VM_GC_INITIAL.
+#define VM_GC_INITIAL (1024 * 1024)
+#define VM_GC_GROW_FACTOR 2
+
+// Strings made by running code are bumped out of a nursery of VM_NURSERY_SIZE
+// bytes unless they are larger than VM_NURSERY_OBJECT_MAX. A minor collection
+// moves the ones still reachable to the old space and empties it.
+#define VM_NURSERY_SIZE (256 * 1024)
+#define VM_NURSERY_OBJECT_MAX (VM_NURSERY_SIZE / 16)
+#define VM_NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Minor collections run early once this many global slots are remembered
+#define VM_REMEMBERED_MAX 1024
+
+// Integers from 0 up to VM_SMALL_INTS turn into strings the VM keeps
+#define VM_SMALL_INTS 1024
+
+#define VM_IS_YOUNG(vm, obj)                                                   \
+    ((uintptr_t)(obj) - (uintptr_t)(vm)->nursery < VM_NURSERY_SIZE)
+#define VM_IS_YOUNG_VALUE(vm, value)                                           \
+    (IS_OBJECT(value) && VM_IS_YOUNG(vm, AS_OBJECT(value)))
 
     typedef struct
     {
@@ -21,17 +56,123 @@ extern "C"
         QxlValue *slots;
     } CallFrame;
 
+    // Allocator of an embedder. `reallocate` follows the contract of
+    // QxlMem_reallocate but returns NULL when it cannot allocate.
+    typedef struct
+    {
+        void *(*reallocate)(void *user_data, void *ptr, size_t size,
+                            size_t new_size);
+        void *user_data;
+    } QxlAllocator;
+
+    typedef struct
+    {
+        const QxlAllocator *allocator; // NULL for the built in one
+        size_t max_bytes;              // heap budget, 0 for no limit
+        // Address space reserved at a time for the small objects, 0 for
+        // QXL_SLAB_REGION_SIZE. Ignored with a custom allocator.
+        size_t heap_region;
+        bool huge_pages; // back the regions with transparent huge pages
+        // Startup image to take the strings, functions and globals from
+        // instead of defining the builtins, NULL for none
+        const char *image;
+    } QxlVMOptions;
+
     typedef struct VM
     {
-        CallFrame frames[VM_FRAMES_MAX];
+        CallFrame *frames;
         int frame_count;
-        QxlValue stack[VM_STACK_MAX];
+        int frame_cap;
+        QxlValue *stack;
         QxlValue *stack_top;
         QxlObject *objects;
         QxlHashTable strings;
-        QxlHashTable globals;
+        QxlString *small_ints[VM_SMALL_INTS]; // interned, NULL until needed
+        QxlHashTable globals;       // global name -> index of its slot
+        QxlValueList global_values; // UNDEFINED_VAL until defined
+        QxlValueList global_names;  // name of each slot, for errors
+        bool register_mode; // compile to and run the OP_R_* instructions
+        const char *builtin_error; // message of the failing builtin
+        uint8_t *image;            // startup image the VM was made from
+        size_t image_size;
+
+        // Garbage collector
+        struct compiler_t *compiler; // innermost function being compiled
+        size_t bytes_allocated;
+        size_t next_gc;
+        int gray_count;
+        int gray_cap;
+        QxlObject **gray_stack;
+
+        // Nursery and the global slots that may point into it
+        uint8_t *nursery;
+        uint8_t *nursery_top;
+        bool minor_gc_pending; // collect the nursery at the next safe point
+        bool evacuating;       // no major collection while objects move
+        int *remembered;
+        int remembered_count;
+        int remembered_cap;
+
+#ifdef SLAB_ALLOCATOR
+        QxlSlabs slabs;
+#endif
+
+        // Where the heap memory comes from and how much of it the VM may
+        // use. Running out of either jumps to `out_of_memory` while code is
+        // being compiled or run.
+        const QxlAllocator *allocator;
+        size_t max_bytes;
+        jmp_buf *out_of_memory;
+
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+        // Bytes allocated by each source line, estimated from one sample
+        // every VM_SAMPLE_PERIOD bytes
+        size_t *sampled_bytes;
+        int sampled_lines;
+        long sample_countdown;
+#endif
     } VM;
 
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+#define VM_SAMPLE_PERIOD 4096
+#endif
+
+    typedef struct
+    {
+        // Objects that survived a full collection, by QxlObjectType. The
+        // bytes of a function do not include its chunk.
+        size_t objects[OBJ_TYPE_COUNT];
+        size_t object_bytes[OBJ_TYPE_COUNT];
+
+        int strings_count; // interned strings
+        int strings_cap;
+        int globals_count; // global names
+        int globals_cap;
+
+        // Chunks of all the functions, by allocated capacity
+        size_t code_bytes;
+        size_t line_bytes;
+        size_t constant_bytes;
+
+        size_t bytes_allocated;
+        size_t image_bytes; // mapped from the startup image, not collected
+
+        // Pages of the small object slabs handed out so far, and how many
+        // times one of them was given back to the OS
+        size_t slab_pages;
+        size_t slab_pages_discarded;
+        // Page faults of the whole process, 0 where the OS does not say
+        long minor_faults;
+        long major_faults;
+
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+        // Estimated bytes allocated by each line so far, line 0 collects the
+        // allocations made outside of running code
+        const size_t *sampled_bytes;
+        int sampled_lines;
+#endif
+    } QxlHeapStats;
+
     typedef enum
     {
         INTERPRET_OK,
@@ -39,11 +180,21 @@ extern "C"
         INTERPRET_RUNTIME_ERROR
     } InterpretResult;
 
-    VM *vm_init();
+    // `options` may be NULL for the defaults. Returns NULL when the image of
+    // the options cannot be loaded.
+    VM *vm_init(const QxlVMOptions *options);
     void vm_free(VM *vm);
+    // Running out of memory ends the script with a runtime error, the VM can
+    // be used again afterwards
     InterpretResult vm_interpret(VM *vm, const char *src);
     void vm_stack_push(VM *vm, QxlValue value);
     QxlValue vm_stack_pop(VM *vm);
+    int vm_global_slot(VM *vm, QxlString *name);
+    // Source line of the innermost frame, as of the last time it stored its
+    // instruction pointer, or 0 when no code is running
+    int vm_current_line(VM *vm);
+    // Runs a full collection and reports what is left on the heap
+    QxlHeapStats vm_heap_stats(VM *vm);
 
 #ifdef __cplusplus
 }
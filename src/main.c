@@ -1,11 +1,14 @@
 #include "include/chunk.h"
 #include "include/debug.h"
+#include "include/image.h"
 #include "include/quixil.h"
+#include "include/snapshot.h"
 #include "include/vm.h"
 
 static void Qxl_main(int argc, const char *argv[]);
 static char *Qxl_read_source(const char *path);
-static void Qxl_run_vm(const char *path);
+static void Qxl_run_vm(const char *path, const QxlVMOptions *options,
+                       bool register_mode, const char *image_out);
 
 int
 main(int argc, const char *argv[])
@@ -13,12 +16,54 @@ main(int argc, const char *argv[])
     Qxl_main(argc, argv);
 }
 
+// Address space reserved at a time for the small objects with --huge-pages,
+// large enough for the kernel to back it with whole huge pages
+#define Qxl_HUGE_PAGE_REGION (256 * 1024 * 1024)
+
 static void
 Qxl_main(int argc, const char *argv[])
 {
-    if (argc == 2)
+    if (argc == 4 && strcmp(argv[1], "--heap-diff") == 0)
     {
-        return Qxl_run_vm(argv[1]);
+        if (QxlSnapshot_diff(argv[2], argv[3], stdout)) return;
+        Qxl_ERROR("Could not read heap snapshots \"%s\" and \"%s\"\n",
+                  argv[2], argv[3]);
+        exit(74);
+    }
+
+    QxlVMOptions options  = {0};
+    bool register_mode    = false;
+    const char *image_out = NULL;
+
+    int arg = 1;
+    for (; arg < argc - 1; arg++)
+    {
+        if (strcmp(argv[arg], "--registers") == 0)
+        {
+            register_mode = true;
+        }
+        else if (strcmp(argv[arg], "--image") == 0 && arg + 2 < argc)
+        {
+            options.image = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--write-image") == 0 && arg + 2 < argc)
+        {
+            image_out = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "--huge-pages") == 0)
+        {
+            options.huge_pages  = true;
+            options.heap_region = Qxl_HUGE_PAGE_REGION;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (arg == argc - 1)
+    {
+        return Qxl_run_vm(argv[arg], &options, register_mode, image_out);
     }
 
     Qxl_ERROR("A runtime error occured");
@@ -61,11 +106,44 @@ Qxl_read_source(const char *path)
 }
 
 static void
-Qxl_run_vm(const char *path)
+Qxl_write_image(VM *vm, const char *path)
 {
-    char *buf           = Qxl_read_source(path);
-    VM *vm              = vm_init();
+    FILE *file   = fopen(path, "wb");
+    bool written = file != NULL && QxlImage_write(vm, file);
+    if (file == NULL || fclose(file) != 0 || !written)
+    {
+        Qxl_ERROR("Could not write image \"%s\"\n", path);
+        exit(74);
+    }
+}
+
+// Runs the script at `path`, and then saves the VM to `image_out` if given
+static void
+Qxl_run_vm(const char *path, const QxlVMOptions *options, bool register_mode,
+           const char *image_out)
+{
+    char *buf = Qxl_read_source(path);
+    VM *vm    = vm_init(options);
+    if (vm == NULL)
+    {
+        Qxl_ERROR("Could not load image \"%s\"\n", options->image);
+        exit(74);
+    }
+
+    // The code in an image is compiled for one of the interpreters
+    if (options->image != NULL && vm->register_mode != register_mode)
+    {
+        Qxl_ERROR("Image \"%s\" was written %s --registers\n", options->image,
+                  vm->register_mode ? "with" : "without");
+        exit(64);
+    }
+    vm->register_mode = register_mode;
+
     InterpretResult res = vm_interpret(vm, buf);
+    if (res == INTERPRET_OK && image_out != NULL)
+    {
+        Qxl_write_image(vm, image_out);
+    }
     vm_free(vm);
     free(buf);
 
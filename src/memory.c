@@ -1,22 +1,252 @@
 #include "include/memory.h"
+#include "include/compiler.h"
+#include "include/object.h"
 
-void *
-QxlMem_reallocate(void *ptr, size_t size, size_t new_size)
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Heap of the VM being called into on this thread, allocations are charged
+// to it and may collect it. Every entry point of a VM attaches it for the
+// length of the call, so another VM on the thread is never charged and its
+// slabs are never handed blocks of this one.
+static _Thread_local VM *heap = NULL;
+
+VM *
+QxlMem_attach(VM *vm)
+{
+    VM *previous = heap;
+    heap         = vm;
+    return previous;
+}
+
+// Gives up on an allocation of the attached VM. Only the code the VM runs
+// or compiles can be unwound, anything else ends the process as before.
+static void
+QxlMem_out_of_memory(VM *vm)
+{
+    if (vm->out_of_memory != NULL) longjmp(*vm->out_of_memory, 1);
+
+    Qxl_ERROR("Out of memory\n");
+    exit(1);
+}
+
+static void *
+QxlMem_system_reallocate(void *ptr, size_t size, size_t new_size)
 {
+#ifdef SLAB_ALLOCATOR
+    if (heap != NULL && (QxlSlab_fits(size) || QxlSlab_fits(new_size)))
+    {
+        return QxlSlab_reallocate(&heap->slabs, ptr, size, new_size);
+    }
+#endif
+
     if (new_size == 0)
     {
         free(ptr);
         return NULL;
     }
 
-    void *result = realloc(ptr, new_size);
-    if (result == NULL)
+    return realloc(ptr, new_size);
+}
+
+void *
+QxlMem_reallocate(void *ptr, size_t size, size_t new_size)
+{
+#ifdef DEBUG_TRACK_ALLOCATIONS
+    if (new_size > size) QxlMem_count_allocation();
+#endif
+
+    if (heap == NULL)
     {
-        exit(1);
+        void *result = QxlMem_system_reallocate(ptr, size, new_size);
+        if (result == NULL && new_size > 0)
+        {
+            exit(1);
+        }
+        return result;
+    }
+
+    heap->bytes_allocated += new_size - size;
+    if (new_size > size)
+    {
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+        QxlMem_sample_allocation(heap, new_size - size);
+#endif
+        if (!heap->evacuating)
+        {
+#ifdef DEBUG_STRESS_GC
+            QxlMem_collect_garbage(heap);
+#else
+            if (heap->bytes_allocated > heap->next_gc ||
+                heap->bytes_allocated > heap->max_bytes)
+            {
+                QxlMem_collect_garbage(heap);
+            }
+#endif
+        }
+
+        if (heap->bytes_allocated > heap->max_bytes)
+        {
+            heap->bytes_allocated -= new_size - size;
+            QxlMem_out_of_memory(heap);
+        }
+    }
+
+    const QxlAllocator *allocator = heap->allocator;
+    void *result =
+        allocator != NULL
+            ? allocator->reallocate(allocator->user_data, ptr, size, new_size)
+            : QxlMem_system_reallocate(ptr, size, new_size);
+    if (result == NULL && new_size > 0)
+    {
+        heap->bytes_allocated -= new_size - size;
+        QxlMem_out_of_memory(heap);
     }
     return result;
 }
 
+#ifdef DEBUG_TRACK_ALLOCATIONS
+int QxlMem_current_op = -1;
+size_t QxlMem_allocations[UINT8_COUNT + 1];
+
+void
+QxlMem_count_allocation(void)
+{
+    QxlMem_allocations[QxlMem_current_op < 0 ? UINT8_COUNT
+                                             : QxlMem_current_op]++;
+}
+#endif
+
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+const uint8_t *QxlMem_current_ip = NULL;
+
+// Returns the source line of the instruction being run, or 0 outside of it
+static int
+QxlMem_current_line(VM *vm)
+{
+    if (vm->frame_count == 0 || QxlMem_current_ip == NULL) return 0;
+
+    QxlChunk *chunk = &vm->frames[vm->frame_count - 1].fn->chunk;
+    size_t offset   = QxlMem_current_ip - chunk->code;
+    return offset < chunk->count ? chunk->lines[offset] : 0;
+}
+
+void
+QxlMem_sample_allocation(VM *vm, size_t size)
+{
+    vm->sample_countdown -= (long)size;
+    if (vm->sample_countdown > 0) return;
+
+    int line = QxlMem_current_line(vm);
+    if (line >= vm->sampled_lines)
+    {
+        // Grown with the system allocator, the samples are not on the heap
+        int lines = line * 2 + 1;
+        vm->sampled_bytes =
+            (size_t *)realloc(vm->sampled_bytes, sizeof(size_t) * lines);
+        if (vm->sampled_bytes == NULL) exit(1);
+        memset(vm->sampled_bytes + vm->sampled_lines, 0,
+               sizeof(size_t) * (lines - vm->sampled_lines));
+        vm->sampled_lines = lines;
+    }
+
+    // Each sample stands for the VM_SAMPLE_PERIOD bytes allocated before it
+    while (vm->sample_countdown <= 0)
+    {
+        vm->sampled_bytes[line] += VM_SAMPLE_PERIOD;
+        vm->sample_countdown += VM_SAMPLE_PERIOD;
+    }
+}
+#endif
+
+static size_t
+QxlMem_page_size()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+static size_t
+QxlMem_round_to_page(size_t size)
+{
+    size_t page = QxlMem_page_size();
+    return (size + page - 1) / page * page;
+}
+
+void *
+QxlMem_reserve(size_t size)
+{
+    size         = QxlMem_round_to_page(size);
+    size_t guard = QxlMem_page_size();
+
+    // Reserve the whole range inaccessible, then open everything but the
+    // last page. Pages are only backed by memory once they are touched.
+#ifdef _WIN32
+    void *ptr = VirtualAlloc(NULL, size + guard, MEM_RESERVE, PAGE_NOACCESS);
+    if (ptr == NULL ||
+        VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) == NULL)
+    {
+        exit(1);
+    }
+#else
+    void *ptr = mmap(NULL, size + guard, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED || mprotect(ptr, size, PROT_READ | PROT_WRITE) != 0)
+    {
+        exit(1);
+    }
+#endif
+
+    return ptr;
+}
+
+void
+QxlMem_release(void *ptr, size_t size)
+{
+    if (ptr == NULL) return;
+
+#ifdef _WIN32
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, QxlMem_round_to_page(size) + QxlMem_page_size());
+#endif
+}
+
+void
+QxlMem_discard(void *ptr, size_t size)
+{
+    // Only whole pages inside the range can be given back
+    size_t page     = QxlMem_page_size();
+    uintptr_t start = ((uintptr_t)ptr + page - 1) / page * page;
+    uintptr_t end   = ((uintptr_t)ptr + size) / page * page;
+    if (start >= end) return;
+
+#ifdef _WIN32
+    VirtualAlloc((void *)start, end - start, MEM_RESET, PAGE_READWRITE);
+#else
+    madvise((void *)start, end - start, MADV_DONTNEED);
+#endif
+}
+
+void
+QxlMem_advise_huge_pages(void *ptr, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, size, MADV_HUGEPAGE);
+#else
+    (void)ptr;
+    (void)size;
+#endif
+}
+
 static void
 QxlMem_free_object(QxlObject *obj)
 {
@@ -25,8 +255,7 @@ QxlMem_free_object(QxlObject *obj)
     case OBJ_STRING:
     {
         QxlString *string = (QxlString *)obj;
-        QxlMem_Free_Array(char, string->chars, string->length + 1);
-        QxlMem_Free(QxlString, obj);
+        QxlMem_reallocate(obj, QxlString_Size(string->length), 0);
         break;
     }
     case OBJ_FUNCTION:
@@ -39,6 +268,9 @@ QxlMem_free_object(QxlObject *obj)
     case OBJ_BUILTIN:
         QxlMem_Free(QxlBuiltin, obj);
         break;
+    case OBJ_ROPE:
+        QxlMem_Free(QxlRope, obj);
+        break;
     }
 }
 
@@ -52,4 +284,230 @@ QxlMem_free_objects(VM *vm)
         QxlMem_free_object(obj);
         obj = next;
     }
-}
\ No newline at end of file
+}
+
+void
+QxlMem_mark_object(VM *vm, QxlObject *obj)
+{
+    // Young strings hold no references and are never swept, the minor
+    // collections take care of them
+    if (obj == NULL || obj->is_marked || VM_IS_YOUNG(vm, obj)) return;
+    obj->is_marked = true;
+
+    // The gray stack is grown with the system allocator so that growing it
+    // never starts a collection of its own.
+    if (vm->gray_count == vm->gray_cap)
+    {
+        vm->gray_cap   = QxlMem_Resize(vm->gray_cap);
+        vm->gray_stack = (QxlObject **)realloc(
+            vm->gray_stack, sizeof(QxlObject *) * vm->gray_cap);
+        if (vm->gray_stack == NULL) exit(1);
+    }
+
+    vm->gray_stack[vm->gray_count++] = obj;
+}
+
+void
+QxlMem_mark_value(VM *vm, QxlValue value)
+{
+    if (IS_OBJECT(value)) QxlMem_mark_object(vm, AS_OBJECT(value));
+}
+
+static void
+mark_list(VM *vm, QxlValueList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        QxlMem_mark_value(vm, list->values[i]);
+    }
+}
+
+static void
+mark_table(VM *vm, QxlHashTable *t)
+{
+    for (int i = 0; i < t->cap; i++)
+    {
+        HashTableEntry *entry = &t->entries[i];
+        QxlMem_mark_object(vm, (QxlObject *)entry->key);
+        QxlMem_mark_value(vm, entry->value);
+    }
+}
+
+static void
+mark_roots(VM *vm)
+{
+    for (QxlValue *slot = vm->stack; slot < vm->stack_top; slot++)
+    {
+        QxlMem_mark_value(vm, *slot);
+    }
+
+    for (int i = 0; i < vm->frame_count; i++)
+    {
+        CallFrame *frame = &vm->frames[i];
+        QxlMem_mark_object(vm, (QxlObject *)frame->fn);
+
+        // A register frame keeps all of its registers while it calls out,
+        // even the ones above the stack top of the callee.
+        if (vm->register_mode)
+        {
+            for (int r = 0; r < frame->fn->max_stack; r++)
+            {
+                QxlMem_mark_value(vm, frame->slots[r]);
+            }
+        }
+    }
+
+    for (int i = 0; i < VM_SMALL_INTS; i++)
+    {
+        QxlMem_mark_object(vm, (QxlObject *)vm->small_ints[i]);
+    }
+
+    mark_table(vm, &vm->globals);
+    mark_list(vm, &vm->global_values);
+    mark_list(vm, &vm->global_names);
+    compiler_mark_roots(vm);
+}
+
+static void
+blacken_object(VM *vm, QxlObject *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_FUNCTION:
+    {
+        QxlFunction *fn = (QxlFunction *)obj;
+        QxlMem_mark_object(vm, (QxlObject *)fn->name);
+        mark_list(vm, &fn->chunk.constants);
+        break;
+    }
+    case OBJ_BUILTIN:
+        QxlMem_mark_object(vm, (QxlObject *)((QxlBuiltin *)obj)->name);
+        break;
+    case OBJ_ROPE:
+    {
+        QxlRope *rope = (QxlRope *)obj;
+        QxlMem_mark_object(vm, rope->left);
+        QxlMem_mark_object(vm, rope->right);
+        QxlMem_mark_object(vm, (QxlObject *)rope->flat);
+        break;
+    }
+    case OBJ_STRING:
+        break;
+    }
+}
+
+static void
+sweep(VM *vm)
+{
+    QxlObject *previous = NULL;
+    QxlObject *obj      = vm->objects;
+    while (obj != NULL)
+    {
+        if (obj->is_marked)
+        {
+            obj->is_marked = false;
+            previous       = obj;
+            obj            = obj->next;
+            continue;
+        }
+
+        QxlObject *unreached = obj;
+        obj                  = obj->next;
+        if (previous != NULL)
+        {
+            previous->next = obj;
+        }
+        else
+        {
+            vm->objects = obj;
+        }
+        QxlMem_free_object(unreached);
+    }
+}
+
+void
+QxlMem_collect_garbage(VM *vm)
+{
+    mark_roots(vm);
+    while (vm->gray_count > 0)
+    {
+        blacken_object(vm, vm->gray_stack[--vm->gray_count]);
+    }
+
+    // Interned strings are only weakly held by the table
+    QxlHashTable_remove_unmarked(&vm->strings);
+    sweep(vm);
+
+    vm->next_gc = vm->bytes_allocated * VM_GC_GROW_FACTOR;
+    if (vm->next_gc < VM_GC_INITIAL) vm->next_gc = VM_GC_INITIAL;
+}
+
+void
+QxlMem_remember_global(VM *vm, int slot)
+{
+    if (vm->remembered_count == vm->remembered_cap)
+    {
+        // The capacity is only updated once the growth cannot fail anymore
+        int cap = QxlMem_Resize(vm->remembered_cap);
+        vm->remembered =
+            QxlMem_Realloc(int, vm->remembered, vm->remembered_cap, cap);
+        vm->remembered_cap = cap;
+    }
+
+    vm->remembered[vm->remembered_count++] = slot;
+    if (vm->remembered_count >= VM_REMEMBERED_MAX) vm->minor_gc_pending = true;
+}
+
+// Returns where a young value lives once evacuated. The first visit promotes
+// the string and leaves a forwarding pointer in its `next`, young objects are
+// on no list so the field is free.
+static QxlValue
+evacuate(VM *vm, QxlValue value)
+{
+    if (!VM_IS_YOUNG_VALUE(vm, value)) return value;
+
+    QxlObject *young = AS_OBJECT(value);
+    if (young->next == NULL)
+    {
+        young->next = (QxlObject *)QxlString_promote(vm, (QxlString *)young);
+    }
+    return OBJECT_VAL(young->next);
+}
+
+void
+QxlMem_collect_nursery(VM *vm)
+{
+    vm->evacuating = true;
+
+    for (QxlValue *slot = vm->stack; slot < vm->stack_top; slot++)
+    {
+        *slot = evacuate(vm, *slot);
+    }
+
+    if (vm->register_mode)
+    {
+        for (int i = 0; i < vm->frame_count; i++)
+        {
+            CallFrame *frame = &vm->frames[i];
+            for (int r = 0; r < frame->fn->max_stack; r++)
+            {
+                frame->slots[r] = evacuate(vm, frame->slots[r]);
+            }
+        }
+    }
+
+    // Only globals can point into the nursery from outside the stack, and
+    // only the slots written since the last minor collection
+    for (int i = 0; i < vm->remembered_count; i++)
+    {
+        QxlValue *global = &vm->global_values.values[vm->remembered[i]];
+        *global          = evacuate(vm, *global);
+    }
+
+    vm->nursery_top      = vm->nursery;
+    vm->remembered_count = 0;
+    vm->minor_gc_pending = false;
+    vm->evacuating       = false;
+
+    if (vm->bytes_allocated > vm->next_gc) QxlMem_collect_garbage(vm);
+}
@@ -0,0 +1,438 @@
+#include "include/number.h"
+
+// Doubles are turned into digits with Grisu2 (Florian Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers", 2010). The
+// digits always read back as the same double and are the shortest such
+// digits for all but a small fraction of doubles, which get one more.
+// Integers that fit a double exactly skip it.
+
+#define DOUBLE_SIGNIFICAND_MASK 0x000fffffffffffffull
+#define DOUBLE_HIDDEN_BIT 0x0010000000000000ull
+#define DOUBLE_EXPONENT_BIAS (0x3ff + 52)
+
+// Doubles up to this size are integers when they have no fraction
+#define EXACT_INTEGER_MAX 9007199254740992.0 // 2^53
+
+// f * 2^e with a full 64 bit significand
+typedef struct
+{
+    uint64_t f;
+    int e;
+} DiyFp;
+
+// Normalized 10^k for k = -348, -340, ..., 340, worked out with exact
+// rational arithmetic and rounded to nearest
+static const DiyFp cached_powers[] = {
+    {0xfa8fd5a0081c0288ull, -1220}, // 1e-348
+    {0xbaaee17fa23ebf76ull, -1193}, // 1e-340
+    {0x8b16fb203055ac76ull, -1166}, // 1e-332
+    {0xcf42894a5dce35eaull, -1140}, // 1e-324
+    {0x9a6bb0aa55653b2dull, -1113}, // 1e-316
+    {0xe61acf033d1a45dfull, -1087}, // 1e-308
+    {0xab70fe17c79ac6caull, -1060}, // 1e-300
+    {0xff77b1fcbebcdc4full, -1034}, // 1e-292
+    {0xbe5691ef416bd60cull, -1007}, // 1e-284
+    {0x8dd01fad907ffc3cull, -980}, // 1e-276
+    {0xd3515c2831559a83ull, -954}, // 1e-268
+    {0x9d71ac8fada6c9b5ull, -927}, // 1e-260
+    {0xea9c227723ee8bcbull, -901}, // 1e-252
+    {0xaecc49914078536dull, -874}, // 1e-244
+    {0x823c12795db6ce57ull, -847}, // 1e-236
+    {0xc21094364dfb5637ull, -821}, // 1e-228
+    {0x9096ea6f3848984full, -794}, // 1e-220
+    {0xd77485cb25823ac7ull, -768}, // 1e-212
+    {0xa086cfcd97bf97f4ull, -741}, // 1e-204
+    {0xef340a98172aace5ull, -715}, // 1e-196
+    {0xb23867fb2a35b28eull, -688}, // 1e-188
+    {0x84c8d4dfd2c63f3bull, -661}, // 1e-180
+    {0xc5dd44271ad3cdbaull, -635}, // 1e-172
+    {0x936b9fcebb25c996ull, -608}, // 1e-164
+    {0xdbac6c247d62a584ull, -582}, // 1e-156
+    {0xa3ab66580d5fdaf6ull, -555}, // 1e-148
+    {0xf3e2f893dec3f126ull, -529}, // 1e-140
+    {0xb5b5ada8aaff80b8ull, -502}, // 1e-132
+    {0x87625f056c7c4a8bull, -475}, // 1e-124
+    {0xc9bcff6034c13053ull, -449}, // 1e-116
+    {0x964e858c91ba2655ull, -422}, // 1e-108
+    {0xdff9772470297ebdull, -396}, // 1e-100
+    {0xa6dfbd9fb8e5b88full, -369}, // 1e-92
+    {0xf8a95fcf88747d94ull, -343}, // 1e-84
+    {0xb94470938fa89bcfull, -316}, // 1e-76
+    {0x8a08f0f8bf0f156bull, -289}, // 1e-68
+    {0xcdb02555653131b6ull, -263}, // 1e-60
+    {0x993fe2c6d07b7facull, -236}, // 1e-52
+    {0xe45c10c42a2b3b06ull, -210}, // 1e-44
+    {0xaa242499697392d3ull, -183}, // 1e-36
+    {0xfd87b5f28300ca0eull, -157}, // 1e-28
+    {0xbce5086492111aebull, -130}, // 1e-20
+    {0x8cbccc096f5088ccull, -103}, // 1e-12
+    {0xd1b71758e219652cull, -77}, // 1e-4
+    {0x9c40000000000000ull, -50}, // 1e4
+    {0xe8d4a51000000000ull, -24}, // 1e12
+    {0xad78ebc5ac620000ull, 3}, // 1e20
+    {0x813f3978f8940984ull, 30}, // 1e28
+    {0xc097ce7bc90715b3ull, 56}, // 1e36
+    {0x8f7e32ce7bea5c70ull, 83}, // 1e44
+    {0xd5d238a4abe98068ull, 109}, // 1e52
+    {0x9f4f2726179a2245ull, 136}, // 1e60
+    {0xed63a231d4c4fb27ull, 162}, // 1e68
+    {0xb0de65388cc8ada8ull, 189}, // 1e76
+    {0x83c7088e1aab65dbull, 216}, // 1e84
+    {0xc45d1df942711d9aull, 242}, // 1e92
+    {0x924d692ca61be758ull, 269}, // 1e100
+    {0xda01ee641a708deaull, 295}, // 1e108
+    {0xa26da3999aef774aull, 322}, // 1e116
+    {0xf209787bb47d6b85ull, 348}, // 1e124
+    {0xb454e4a179dd1877ull, 375}, // 1e132
+    {0x865b86925b9bc5c2ull, 402}, // 1e140
+    {0xc83553c5c8965d3dull, 428}, // 1e148
+    {0x952ab45cfa97a0b3ull, 455}, // 1e156
+    {0xde469fbd99a05fe3ull, 481}, // 1e164
+    {0xa59bc234db398c25ull, 508}, // 1e172
+    {0xf6c69a72a3989f5cull, 534}, // 1e180
+    {0xb7dcbf5354e9beceull, 561}, // 1e188
+    {0x88fcf317f22241e2ull, 588}, // 1e196
+    {0xcc20ce9bd35c78a5ull, 614}, // 1e204
+    {0x98165af37b2153dfull, 641}, // 1e212
+    {0xe2a0b5dc971f303aull, 667}, // 1e220
+    {0xa8d9d1535ce3b396ull, 694}, // 1e228
+    {0xfb9b7cd9a4a7443cull, 720}, // 1e236
+    {0xbb764c4ca7a44410ull, 747}, // 1e244
+    {0x8bab8eefb6409c1aull, 774}, // 1e252
+    {0xd01fef10a657842cull, 800}, // 1e260
+    {0x9b10a4e5e9913129ull, 827}, // 1e268
+    {0xe7109bfba19c0c9dull, 853}, // 1e276
+    {0xac2820d9623bf429ull, 880}, // 1e284
+    {0x80444b5e7aa7cf85ull, 907}, // 1e292
+    {0xbf21e44003acdd2dull, 933}, // 1e300
+    {0x8e679c2f5e44ff8full, 960}, // 1e308
+    {0xd433179d9c8cb841ull, 986}, // 1e316
+    {0x9e19db92b4e31ba9ull, 1013}, // 1e324
+    {0xeb96bf6ebadf77d9ull, 1039}, // 1e332
+    {0xaf87023b9bf0ee6bull, 1066}, // 1e340
+};
+
+static const uint64_t powers_of_ten[] = {
+    1ull,
+    10ull,
+    100ull,
+    1000ull,
+    10000ull,
+    100000ull,
+    1000000ull,
+    10000000ull,
+    100000000ull,
+    1000000000ull,
+    10000000000ull,
+    100000000000ull,
+    1000000000000ull,
+    10000000000000ull,
+    100000000000000ull,
+    1000000000000000ull,
+    10000000000000000ull,
+    100000000000000000ull,
+    1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+#define POWERS_OF_TEN (int)(sizeof(powers_of_ten) / sizeof(powers_of_ten[0]))
+
+static DiyFp
+diy_from_double(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased           = (int)((bits >> 52) & 0x7ff);
+    uint64_t significand = bits & DOUBLE_SIGNIFICAND_MASK;
+
+    DiyFp v;
+    if (biased != 0)
+    {
+        v.f = significand + DOUBLE_HIDDEN_BIT;
+        v.e = biased - DOUBLE_EXPONENT_BIAS;
+    }
+    else
+    {
+        // Subnormal
+        v.f = significand;
+        v.e = 1 - DOUBLE_EXPONENT_BIAS;
+    }
+    return v;
+}
+
+static DiyFp
+diy_normalize(DiyFp v)
+{
+    while (!(v.f & (1ull << 63)))
+    {
+        v.f <<= 1;
+        v.e--;
+    }
+    return v;
+}
+
+// Upper 64 bits of the product, rounded
+static DiyFp
+diy_multiply(DiyFp x, DiyFp y)
+{
+    DiyFp product;
+#ifdef __SIZEOF_INT128__
+    __uint128_t p = (__uint128_t)x.f * y.f;
+    product.f     = (uint64_t)(p >> 64) + (((uint64_t)p >> 63) & 1);
+#else
+    uint64_t a = x.f >> 32, b = x.f & 0xffffffffull;
+    uint64_t c = y.f >> 32, d = y.f & 0xffffffffull;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t middle = (bd >> 32) + (ad & 0xffffffffull) +
+                      (bc & 0xffffffffull) + (1ull << 31);
+    product.f = ac + (ad >> 32) + (bc >> 32) + (middle >> 32);
+#endif
+    product.e = x.e + y.e + 64;
+    return product;
+}
+
+// The doubles halfway to the neighbours of `v`, sharing an exponent with
+// `plus` normalized
+static void
+diy_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus)
+{
+    DiyFp upper = {(v.f << 1) + 1, v.e - 1};
+    while (!(upper.f & (DOUBLE_HIDDEN_BIT << 1)))
+    {
+        upper.f <<= 1;
+        upper.e--;
+    }
+    upper.f <<= 64 - 52 - 2;
+    upper.e -= 64 - 52 - 2;
+
+    // The gap below a power of two is half the gap above it
+    DiyFp lower = v.f == DOUBLE_HIDDEN_BIT ? (DiyFp){(v.f << 2) - 1, v.e - 2}
+                                           : (DiyFp){(v.f << 1) - 1, v.e - 1};
+    lower.f <<= lower.e - upper.e;
+    lower.e = upper.e;
+
+    *minus = lower;
+    *plus  = upper;
+}
+
+// The cached power that brings a number with binary exponent `e` to an
+// exponent between -60 and -32, and its decimal exponent negated in `*k`
+static DiyFp
+cached_power(int e, int *k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347; // log10(2)
+    int up    = (int)dk;
+    if (dk - up > 0.0) up++;
+
+    int index = (up >> 3) + 1;
+    *k        = -(-348 + (index << 3));
+    return cached_powers[index];
+}
+
+static int
+count_digits(uint32_t n)
+{
+    int count = 1;
+    while (n >= 10)
+    {
+        n /= 10;
+        count++;
+    }
+    return count;
+}
+
+// Moves the last digit down while that brings the digits closer to the
+// number and keeps them inside the boundaries
+static void
+round_digits(char *digits, int length, uint64_t delta, uint64_t rest,
+             uint64_t ten_kappa, uint64_t distance)
+{
+    while (rest < distance && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < distance ||
+            distance - rest > rest + ten_kappa - distance))
+    {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+// Writes the digits of `upper` until they are closer to `w` than `delta`.
+// Adds the number of digits left out to `*k`.
+static int
+generate_digits(DiyFp w, DiyFp upper, uint64_t delta, char *digits, int *k)
+{
+    int shift         = -upper.e;
+    uint64_t one      = 1ull << shift;
+    uint64_t distance = upper.f - w.f;
+    uint32_t integral = (uint32_t)(upper.f >> shift);
+    uint64_t fraction = upper.f & (one - 1);
+    int kappa         = count_digits(integral);
+    int length        = 0;
+
+    while (kappa > 0)
+    {
+        uint32_t power = (uint32_t)powers_of_ten[kappa - 1];
+        uint32_t digit = integral / power;
+        integral %= power;
+        if (digit != 0 || length != 0) digits[length++] = (char)('0' + digit);
+        kappa--;
+
+        uint64_t rest = ((uint64_t)integral << shift) + fraction;
+        if (rest <= delta)
+        {
+            *k += kappa;
+            round_digits(digits, length, delta, rest,
+                         powers_of_ten[kappa] << shift, distance);
+            return length;
+        }
+    }
+
+    for (;;)
+    {
+        fraction *= 10;
+        delta *= 10;
+        char digit = (char)(fraction >> shift);
+        if (digit != 0 || length != 0) digits[length++] = (char)('0' + digit);
+        fraction &= one - 1;
+        kappa--;
+
+        if (fraction < delta)
+        {
+            *k += kappa;
+            uint64_t scale =
+                -kappa < POWERS_OF_TEN ? powers_of_ten[-kappa] : 0;
+            round_digits(digits, length, delta, fraction, one,
+                         distance * scale);
+            return length;
+        }
+    }
+}
+
+// Digits of a positive double and the power of ten they are scaled by
+static int
+grisu2(double value, char *digits, int *k)
+{
+    DiyFp v = diy_from_double(value);
+    DiyFp minus, plus;
+    diy_boundaries(v, &minus, &plus);
+
+    DiyFp c     = cached_power(plus.e, k);
+    DiyFp w     = diy_multiply(diy_normalize(v), c);
+    DiyFp upper = diy_multiply(plus, c);
+    DiyFp lower = diy_multiply(minus, c);
+
+    // Stay strictly inside the boundaries, the products may be off by one
+    lower.f++;
+    upper.f--;
+    return generate_digits(w, upper, upper.f - lower.f, digits, k);
+}
+
+static int
+write_integer(char *dest, uint64_t n)
+{
+    char digits[20];
+    int length = 0;
+    do
+    {
+        digits[length++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+
+    for (int i = 0; i < length; i++)
+    {
+        dest[i] = digits[length - 1 - i];
+    }
+    return length;
+}
+
+// Lays out `length` digits scaled by 10^k. `point` is where the decimal
+// point goes counting from the first digit.
+static int
+write_digits(char *dest, const char *digits, int length, int k)
+{
+    int point = length + k;
+    char *p   = dest;
+
+    if (length <= point && point <= 21)
+    {
+        memcpy(p, digits, length);
+        memset(p + length, '0', point - length);
+        return point;
+    }
+
+    if (0 < point && point <= 21)
+    {
+        memcpy(p, digits, point);
+        p[point] = '.';
+        memcpy(p + point + 1, digits + point, length - point);
+        return length + 1;
+    }
+
+    if (-6 < point && point <= 0)
+    {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -point);
+        p += -point;
+        memcpy(p, digits, length);
+        return (int)(p - dest) + length;
+    }
+
+    *p++ = digits[0];
+    if (length > 1)
+    {
+        *p++ = '.';
+        memcpy(p, digits + 1, length - 1);
+        p += length - 1;
+    }
+
+    int exponent = point - 1;
+    *p++         = 'e';
+    *p++         = exponent < 0 ? '-' : '+';
+    p += write_integer(p, exponent < 0 ? -exponent : exponent);
+    return (int)(p - dest);
+}
+
+int
+Qxl_num_format(char *dest, double value)
+{
+    if (value != value)
+    {
+        memcpy(dest, "nan", 3);
+        return 3;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    char *p = dest;
+    if (bits >> 63)
+    {
+        *p++  = '-';
+        value = -value;
+    }
+
+    if (value > 1.7976931348623157e308)
+    {
+        memcpy(p, "inf", 3);
+        return (int)(p - dest) + 3;
+    }
+
+    if (value <= EXACT_INTEGER_MAX && value == (double)(uint64_t)value)
+    {
+        return (int)(p - dest) + write_integer(p, (uint64_t)value);
+    }
+
+    char digits[32];
+    int k;
+    int length = grisu2(value, digits, &k);
+    return (int)(p - dest) + write_digits(p, digits, length, k);
+}
+
+char *
+Qxl_num_as_str(double value)
+{
+    char *str = (char *)malloc(QXL_NUM_CHARS_MAX + 1);
+    if (str == NULL) return NULL;
+    str[Qxl_num_format(str, value)] = '\0';
+    return str;
+}
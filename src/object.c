@@ -2,20 +2,75 @@
 #include "include/collections.h"
 #include "include/common.h"
 #include "include/memory.h"
+#include "include/number.h"
 #include "include/quixil.h"
 #include "include/value.h"
 
-#define ALLOCATE_OBJECT(vm, qxl_type, obj_type, obj_name)                      \
-    (qxl_type *)QxlObject_allocate(vm, obj_type, sizeof(qxl_type), obj_name)
+#include <limits.h>
+#include <math.h>
+
+#define ALLOCATE_OBJECT(vm, qxl_type, obj_type)                                \
+    (qxl_type *)QxlObject_allocate(vm, obj_type, sizeof(qxl_type))
 
 // QxlObject
 
+const char *QxlObject_type_names[] = {
+    [OBJ_STRING]   = "str",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_BUILTIN]  = "builtin",
+    [OBJ_ROPE]     = "rope",
+};
+
+// Walks the flat strings a string or rope is made of, from left to right.
+// Ropes can be as deep as they are long, so the sides still to visit are kept
+// on a stack grown with the system allocator.
+typedef struct
+{
+    QxlObject **pending;
+    int count;
+    int cap;
+} StringWalk;
+
+static void
+walk_push(StringWalk *walk, QxlObject *string)
+{
+    if (walk->count == walk->cap)
+    {
+        walk->cap     = QxlMem_Resize(walk->cap);
+        walk->pending = (QxlObject **)realloc(
+            walk->pending, sizeof(QxlObject *) * walk->cap);
+        if (walk->pending == NULL) exit(1);
+    }
+    walk->pending[walk->count++] = string;
+}
+
+// Returns the next flat piece, or NULL and frees the stack at the end
+static QxlString *
+walk_next(StringWalk *walk)
+{
+    while (walk->count > 0)
+    {
+        QxlObject *string = walk->pending[--walk->count];
+        if (string->type == OBJ_STRING) return (QxlString *)string;
+
+        QxlRope *rope = (QxlRope *)string;
+        if (rope->flat != NULL) return rope->flat;
+        walk_push(walk, rope->right);
+        walk_push(walk, rope->left);
+    }
+
+    free(walk->pending);
+    walk->pending = NULL;
+    return NULL;
+}
+
 static QxlObject *
-QxlObject_allocate(VM *vm, QxlObjectType type, size_t size, char *obj_name)
+QxlObject_allocate(VM *vm, QxlObjectType type, size_t size)
 {
     QxlObject *object = (QxlObject *)QxlMem_reallocate(NULL, 0, size);
     object->type      = type;
-    object->obj_name  = obj_name;
+    object->is_marked = false;
+    object->line      = vm_current_line(vm);
     object->next      = vm->objects;
     vm->objects       = object;
 
@@ -42,84 +97,378 @@ QxlObject_print(QxlValue value)
     case OBJ_BUILTIN:
         printf("<built-in function %s>", AS_BUILTIN(value)->name->chars);
         break;
+    case OBJ_ROPE:
+    {
+        StringWalk walk = {NULL, 0, 0};
+        walk_push(&walk, AS_OBJECT(value));
+        for (QxlString *piece; (piece = walk_next(&walk)) != NULL;)
+        {
+            fwrite(piece->chars, 1, piece->length, stdout);
+        }
+        break;
+    }
     }
 }
 
 // QxlString
 
+// Allocates an old string of `length` chars for the caller to fill in. It is
+// on no list until QxlString_link or QxlString_intern, so a collection in
+// between misses it.
 static QxlString *
-QxlString_allocate(VM *vm, char *chars, int length, uint32_t hash)
+QxlString_allocate(VM *vm, int length)
 {
-    QxlString *string = ALLOCATE_OBJECT(vm, QxlString, OBJ_STRING, "str");
-    string->length    = length;
-    string->chars     = chars;
-    string->hash      = hash;
+    QxlString *string =
+        (QxlString *)QxlMem_reallocate(NULL, 0, QxlString_Size(length));
+    string->obj.type      = OBJ_STRING;
+    string->obj.is_marked = false;
+    string->obj.line      = vm_current_line(vm);
+    string->obj.next      = NULL;
+    string->length        = length;
+    string->hash          = 0;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Links a filled in old string into the heap without interning it
+static QxlString *
+QxlString_link(VM *vm, QxlString *string)
+{
+    string->obj.next = vm->objects;
+    vm->objects      = (QxlObject *)string;
+    return string;
+}
+
+// Links a filled in old string into the heap and the intern table
+static QxlString *
+QxlString_intern(VM *vm, QxlString *string)
+{
+    QxlString_link(vm, string);
+
+    // Growing the table can collect, keep the string reachable until then
+    vm_stack_push(vm, OBJECT_VAL(string));
     QxlHashTable_put(&vm->strings, string, NIL_VAL);
+    vm_stack_pop(vm);
+    return string;
+}
+
+// Bumps a string of `length` chars out of the nursery for the caller to fill
+// in. Young strings are only made while code runs. Returns NULL when the
+// string has to be made in the old space instead.
+static QxlString *
+QxlString_young(VM *vm, int length)
+{
+    size_t size = VM_NURSERY_ALIGN(QxlString_Size(length));
+    if (vm->frame_count == 0 || size > VM_NURSERY_OBJECT_MAX) return NULL;
+    if (vm->nursery_top + size > vm->nursery + VM_NURSERY_SIZE)
+    {
+        vm->minor_gc_pending = true;
+        return NULL;
+    }
+
+    QxlString *string = (QxlString *)vm->nursery_top;
+    vm->nursery_top += size;
+#ifdef DEBUG_TRACK_ALLOCATIONS
+    QxlMem_count_allocation();
+#endif
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+    QxlMem_sample_allocation(vm, size);
+#endif
+    string->obj.type      = OBJ_STRING;
+    string->obj.is_marked = false;
+    string->obj.line      = vm_current_line(vm);
+    string->obj.next      = NULL;
+    string->length        = length;
+    string->hash          = 0;
+    string->chars[length] = '\0';
     return string;
 }
 
+// Strings made while code runs are mostly temporaries that are never looked
+// up, so they are neither hashed nor interned. Equality compares them by
+// their chars and a hash table hashes them when they become a key.
+static QxlString *
+QxlString_finish(VM *vm, QxlString *string)
+{
+    return VM_IS_YOUNG(vm, string) ? string : QxlString_link(vm, string);
+}
+
+static QxlString *
+QxlString_reserve(VM *vm, int length)
+{
+    QxlString *young = QxlString_young(vm, length);
+    return young != NULL ? young : QxlString_allocate(vm, length);
+}
+
 QxlString *
 QxlString_copy(VM *vm, const char *chars, int length)
 {
     uint32_t hash = Qxl_hash_str(chars, length);
-
     QxlString *interned =
         QxlHashTable_find_string(&vm->strings, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char *heap_chars = QxlMem_Allocate(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return QxlString_allocate(vm, heap_chars, length, hash);
+    QxlString *string = QxlString_reserve(vm, length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return VM_IS_YOUNG(vm, string) ? string : QxlString_intern(vm, string);
 }
 
 QxlString *
-QxlString_take(VM *vm, char *chars, int length)
+QxlString_new(VM *vm, const char *chars, int length)
 {
-    uint32_t hash = Qxl_hash_str(chars, length);
-    QxlString *interned =
-        QxlHashTable_find_string(&vm->strings, chars, length, hash);
-    if (interned != NULL)
-    {
-        QxlMem_Free_Array(char, chars, length + 1);
-        return interned;
-    }
-
-    return QxlString_allocate(vm, chars, length, hash);
+    QxlString *string = QxlString_reserve(vm, length);
+    memcpy(string->chars, chars, length);
+    return QxlString_finish(vm, string);
 }
 
 QxlString *
 QxlString_concatenate(VM *vm, QxlString *a, QxlString *b)
 {
-    int length  = a->length + b->length;
-    char *chars = QxlMem_Allocate(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    return QxlString_take(vm, chars, length);
+    QxlString *string = QxlString_reserve(vm, a->length + b->length);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+    return QxlString_finish(vm, string);
 }
 
 QxlString *
 QxlString_repeat(VM *vm, QxlString *s, int count)
 {
-    size_t length = s->length * count;
-    char *chars   = QxlMem_Allocate(char, length + 1);
-    char *dest    = chars;
-
     if (count <= 0 || s->length == 0)
     {
-        return QxlString_take(vm, "", 0);
+        return QxlString_copy(vm, "", 0);
     }
 
-    for (size_t i = 0; i < count; i++)
+    QxlString *string = QxlString_reserve(vm, s->length * count);
+    char *dest        = string->chars;
+    for (int i = 0; i < count; i++)
     {
         memcpy(dest, s->chars, s->length);
         dest += s->length;
     }
-    chars[length] = '\0';
 
-    return QxlString_take(vm, chars, length);
+    return QxlString_finish(vm, string);
+}
+
+QxlString *
+QxlString_build(VM *vm, QxlValue *parts, int count, int length)
+{
+    QxlString *string = QxlString_reserve(vm, length);
+    char *dest        = string->chars;
+    for (int i = 0; i < count; i++)
+    {
+        if (IS_NUMBER(parts[i]))
+        {
+            dest += Qxl_num_format(dest, AS_NUMBER(parts[i]));
+        }
+        else
+        {
+            QxlString_copy_chars(AS_OBJECT(parts[i]), dest);
+            dest += QxlString_length(AS_OBJECT(parts[i]));
+        }
+    }
+
+    return QxlString_finish(vm, string);
+}
+
+QxlString *
+QxlString_from_number(VM *vm, double value)
+{
+    char chars[QXL_NUM_CHARS_MAX];
+    int length = Qxl_num_format(chars, value);
+    // -0 passes the range check but is written "-0"
+    if (!(value >= 0 && value < VM_SMALL_INTS && value == (int)value) ||
+        signbit(value))
+    {
+        return QxlString_new(vm, chars, length);
+    }
+
+    // Made old and interned once, every later use of the number shares it
+    QxlString **cached = &vm->small_ints[(int)value];
+    if (*cached == NULL)
+    {
+        uint32_t hash = Qxl_hash_str(chars, length);
+        QxlString *string =
+            QxlHashTable_find_string(&vm->strings, chars, length, hash);
+        if (string == NULL)
+        {
+            string = QxlString_allocate(vm, length);
+            memcpy(string->chars, chars, length);
+            string->hash = hash;
+            QxlString_intern(vm, string);
+        }
+        *cached = string;
+    }
+    return *cached;
+}
+
+QxlString *
+QxlString_promote(VM *vm, QxlString *young)
+{
+    QxlString *string = QxlString_allocate(vm, young->length);
+    memcpy(string->chars, young->chars, young->length);
+    string->hash     = young->hash;
+    string->obj.line = young->obj.line;
+    return QxlString_link(vm, string);
+}
+
+int
+QxlString_length(QxlObject *string)
+{
+    return string->type == OBJ_STRING ? ((QxlString *)string)->length
+                                      : ((QxlRope *)string)->length;
+}
+
+// Returns what a rope can hold on to for one side of a concatenation
+static QxlObject *
+QxlRope_side(VM *vm, QxlObject *string)
+{
+    if (string->type == OBJ_ROPE)
+    {
+        QxlRope *rope = (QxlRope *)string;
+        return rope->flat != NULL ? (QxlObject *)rope->flat : string;
+    }
+    return VM_IS_YOUNG(vm, string)
+               ? (QxlObject *)QxlString_promote(vm, (QxlString *)string)
+               : string;
+}
+
+QxlObject *
+QxlString_join(VM *vm, QxlObject *a, QxlObject *b)
+{
+    int a_length = QxlString_length(a);
+    int b_length = QxlString_length(b);
+    if (a_length > INT_MAX - b_length) return NULL;
+
+    // Ropes are never this short, so both sides are flat
+    if (a_length + b_length < QXL_ROPE_MIN)
+    {
+        return (QxlObject *)QxlString_concatenate(vm, (QxlString *)a,
+                                                  (QxlString *)b);
+    }
+
+    // Appending a short string to a rope that ends in a short piece copies
+    // the two into a new last piece. A rope built a little at a time is then
+    // made of pieces close to QXL_ROPE_MIN long rather than one per append.
+    QxlRope *rope = (QxlRope *)a;
+    if (a->type == OBJ_ROPE && rope->flat == NULL &&
+        b->type == OBJ_STRING && rope->right->type == OBJ_STRING &&
+        QxlString_length(rope->right) + b_length < QXL_ROPE_MIN)
+    {
+        QxlString *last  = (QxlString *)rope->right;
+        QxlString *piece = QxlString_allocate(vm, last->length + b_length);
+        memcpy(piece->chars, last->chars, last->length);
+        memcpy(piece->chars + last->length, ((QxlString *)b)->chars, b_length);
+        a = rope->left;
+        b = (QxlObject *)QxlString_link(vm, piece);
+    }
+    else
+    {
+        // Only the globals are tracked for pointers into the nursery, so a
+        // rope holds on to old strings
+        a = QxlRope_side(vm, a);
+        vm_stack_push(vm, OBJECT_VAL(a));
+        b = QxlRope_side(vm, b);
+        vm_stack_pop(vm);
+    }
+
+    // The sides stay on the stack until the rope exists
+    vm_stack_push(vm, OBJECT_VAL(a));
+    vm_stack_push(vm, OBJECT_VAL(b));
+    rope         = ALLOCATE_OBJECT(vm, QxlRope, OBJ_ROPE);
+    rope->length = a_length + b_length;
+    rope->left   = a;
+    rope->right  = b;
+    rope->flat   = NULL;
+
+    vm->stack_top -= 2;
+    return (QxlObject *)rope;
+}
+
+QxlString *
+QxlString_flatten(VM *vm, QxlObject *string)
+{
+    if (string->type == OBJ_STRING) return (QxlString *)string;
+
+    QxlRope *rope = (QxlRope *)string;
+    if (rope->flat != NULL) return rope->flat;
+
+    // Made old, the rope points to it
+    QxlString *flat = QxlString_allocate(vm, rope->length);
+    QxlString_copy_chars(string, flat->chars);
+    flat = QxlString_finish(vm, flat);
+    rope->flat  = flat;
+    rope->left  = NULL;
+    rope->right = NULL;
+    return flat;
+}
+
+void
+QxlString_copy_chars(QxlObject *string, char *dest)
+{
+    if (string->type == OBJ_STRING)
+    {
+        memcpy(dest, ((QxlString *)string)->chars, QxlString_length(string));
+        return;
+    }
+
+    StringWalk walk = {NULL, 0, 0};
+    walk_push(&walk, string);
+    for (QxlString *piece; (piece = walk_next(&walk)) != NULL;)
+    {
+        memcpy(dest, piece->chars, piece->length);
+        dest += piece->length;
+    }
+}
+
+bool
+QxlString_equals(QxlObject *a, QxlObject *b)
+{
+    if (a->type == OBJ_STRING && b->type == OBJ_STRING)
+    {
+        QxlString *x = (QxlString *)a;
+        QxlString *y = (QxlString *)b;
+        // Only hashes both strings have already worked out are compared
+        if (x->hash != 0 && y->hash != 0 && x->hash != y->hash) return false;
+        return x->length == y->length &&
+               memcmp(x->chars, y->chars, x->length) == 0;
+    }
+    if (QxlString_length(a) != QxlString_length(b)) return false;
+
+    // Compare piece by piece, the pieces of the two need not line up
+    StringWalk x_walk = {NULL, 0, 0};
+    StringWalk y_walk = {NULL, 0, 0};
+    walk_push(&x_walk, a);
+    walk_push(&y_walk, b);
+    QxlString *x = walk_next(&x_walk);
+    QxlString *y = walk_next(&y_walk);
+    int x_offset = 0;
+    int y_offset = 0;
+    bool equal   = true;
+
+    while (equal && x != NULL && y != NULL)
+    {
+        int x_left = x->length - x_offset;
+        int y_left = y->length - y_offset;
+        int length = x_left < y_left ? x_left : y_left;
+        equal = memcmp(x->chars + x_offset, y->chars + y_offset, length) == 0;
+        x_offset += length;
+        y_offset += length;
+        if (x_offset == x->length)
+        {
+            x        = walk_next(&x_walk);
+            x_offset = 0;
+        }
+        if (y_offset == y->length)
+        {
+            y        = walk_next(&y_walk);
+            y_offset = 0;
+        }
+    }
+
+    free(x_walk.pending);
+    free(y_walk.pending);
+    return equal;
 }
 
 // QxlFunction
@@ -127,10 +476,10 @@ QxlString_repeat(VM *vm, QxlString *s, int count)
 QxlFunction *
 QxlFunction_new(VM *vm)
 {
-    QxlFunction *fn =
-        ALLOCATE_OBJECT(vm, QxlFunction, OBJ_FUNCTION, "function");
-    fn->arity = 0;
-    fn->name  = NULL;
+    QxlFunction *fn = ALLOCATE_OBJECT(vm, QxlFunction, OBJ_FUNCTION);
+    fn->arity       = 0;
+    fn->max_stack   = 0;
+    fn->name        = NULL;
     QxlChunk_init(&fn->chunk);
     return fn;
 }
@@ -138,10 +487,10 @@ QxlFunction_new(VM *vm)
 // QxlBuiltin
 
 QxlBuiltin *
-QxlBuiltin_new(VM *vm, QxlString *name, BuiltinFn fn)
+QxlBuiltin_new(VM *vm, QxlString *name, const QxlBuiltinDef *def)
 {
-    QxlBuiltin *bltin = ALLOCATE_OBJECT(vm, QxlBuiltin, OBJ_BUILTIN, "builtin");
-    bltin->fn         = fn;
+    QxlBuiltin *bltin = ALLOCATE_OBJECT(vm, QxlBuiltin, OBJ_BUILTIN);
+    bltin->def        = def;
     bltin->name       = name;
     return bltin;
 }
\ No newline at end of file
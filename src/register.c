@@ -0,0 +1,513 @@
+#include "include/register.h"
+#include "include/memory.h"
+
+// A value on the virtual stack either lives in its own slot or is a copy of a
+// lower register that hasn't been moved yet.
+#define REAL -1
+#define REG(t, p) ((t)->alias[(p)] == REAL ? (p) : (t)->alias[(p)])
+
+typedef struct
+{
+    int at;     // offset of the 16 bit operand in the new code
+    int target; // offset the jump lands on in the old code
+} Fixup;
+
+typedef struct
+{
+    QxlChunk *in;
+    QxlChunk out;
+    bool *labels;  // old offsets some jump lands on
+    int *depths;   // stack depth at each label, -1 until a jump is seen
+    int *offsets;  // old offset -> new offset
+    Fixup *fixups;
+    int fixup_count;
+    int alias[UINT8_COUNT]; // source register of each stack value, or REAL
+    int top;
+    int max;
+    int last_dest; // offset of the destination operand of the last
+                   // instruction when it can be retargeted, -1 otherwise
+    int line;
+    bool reachable; // false after an unconditional jump or a return
+    bool ok;
+} Translator;
+
+static void
+emit(Translator *t, uint8_t byte)
+{
+    QxlChunk_add(&t->out, byte, t->line);
+}
+
+static void
+emit_op(Translator *t, uint8_t op)
+{
+    t->last_dest = -1;
+    emit(t, op);
+}
+
+// Emits an instruction whose first operand is the register it writes, a
+// following store into a local may redirect it there.
+static void
+emit_dest(Translator *t, uint8_t op, int dest)
+{
+    emit_op(t, op);
+    t->last_dest = t->out.count;
+    emit(t, dest);
+}
+
+static void
+emit_jump(Translator *t, int target)
+{
+    Fixup *fixup  = &t->fixups[t->fixup_count++];
+    fixup->at     = t->out.count;
+    fixup->target = target;
+    emit(t, 0xff);
+    emit(t, 0xff);
+
+    if (t->depths[target] == -1)
+    {
+        t->depths[target] = t->top;
+    }
+    else if (t->depths[target] != t->top)
+    {
+        t->ok = false;
+    }
+}
+
+static int
+push(Translator *t)
+{
+    if (t->top == UINT8_COUNT)
+    {
+        t->ok = false;
+        return t->top - 1;
+    }
+
+    t->alias[t->top] = REAL;
+    if (++t->top > t->max) t->max = t->top;
+    return t->top - 1;
+}
+
+static void
+materialize(Translator *t, int from, int to)
+{
+    for (int p = from; p < to; p++)
+    {
+        if (t->alias[p] == REAL) continue;
+        emit_dest(t, OP_R_MOVE, p);
+        emit(t, t->alias[p]);
+        t->alias[p] = REAL;
+    }
+}
+
+// Stores the value on top of the stack into local `slot`. Copies of the old
+// value still on the stack are moved into their own slots first.
+static void
+set_local(Translator *t, int slot)
+{
+    int top = t->top - 1;
+    int src = REG(t, top);
+    if (src != slot)
+    {
+        for (int p = slot + 1; p < top; p++)
+        {
+            if (t->alias[p] == slot) materialize(t, p, p + 1);
+        }
+
+        if (t->last_dest != -1 && t->out.code[t->last_dest] == top &&
+            t->alias[top] == REAL)
+        {
+            t->out.code[t->last_dest] = slot;
+        }
+        else
+        {
+            emit_dest(t, OP_R_MOVE, slot);
+            emit(t, src);
+        }
+        t->alias[slot] = REAL;
+    }
+    t->alias[top] = slot;
+}
+
+static void
+unary(Translator *t, uint8_t op)
+{
+    int a = REG(t, t->top - 1);
+    t->top--;
+    emit_dest(t, op, push(t));
+    emit(t, a);
+}
+
+static void
+binary(Translator *t, uint8_t op)
+{
+    int a = REG(t, t->top - 2);
+    int b = REG(t, t->top - 1);
+    t->top -= 2;
+    emit_dest(t, op, push(t));
+    emit(t, a);
+    emit(t, b);
+}
+
+static uint8_t
+generic_op(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_ADD_NUMBER:
+        return OP_ADD;
+    case OP_SUBTRACT_NUMBER:
+        return OP_SUBTRACT;
+    case OP_GREATER_NUMBER:
+        return OP_GREATER;
+    case OP_LESS_NUMBER:
+        return OP_LESS;
+    case OP_GREATER_EQUAL_NUMBER:
+        return OP_GREATER_EQUAL;
+    case OP_LESS_EQUAL_NUMBER:
+        return OP_LESS_EQUAL;
+    case OP_CALL_BUILTIN:
+        return OP_CALL;
+    default:
+        return op;
+    }
+}
+
+// Translates the instruction at `offset`, returns the offset of the next one.
+static int
+translate(Translator *t, int offset)
+{
+    uint8_t *code = t->in->code;
+    int next      = offset + QxlChunk_instruction_length(code[offset]);
+
+    switch (generic_op(code[offset]))
+    {
+    case OP_CONSTANT:
+        emit_dest(t, OP_R_LOADK, push(t));
+        emit(t, code[offset + 1]);
+        break;
+    case OP_NIL:
+        emit_dest(t, OP_R_NIL, push(t));
+        break;
+    case OP_TRUE:
+        emit_dest(t, OP_R_TRUE, push(t));
+        break;
+    case OP_FALSE:
+        emit_dest(t, OP_R_FALSE, push(t));
+        break;
+    case OP_NEGATE:
+        unary(t, OP_R_NEGATE);
+        break;
+    case OP_NOT:
+        unary(t, OP_R_NOT);
+        break;
+    case OP_ADD:
+        binary(t, OP_R_ADD);
+        break;
+    case OP_SUBTRACT:
+        binary(t, OP_R_SUBTRACT);
+        break;
+    case OP_MULTIPLY:
+        binary(t, OP_R_MULTIPLY);
+        break;
+    case OP_DIVIDE:
+        binary(t, OP_R_DIVIDE);
+        break;
+    case OP_EQUAL:
+        binary(t, OP_R_EQUAL);
+        break;
+    case OP_NOT_EQUAL:
+        binary(t, OP_R_NOT_EQUAL);
+        break;
+    case OP_GREATER:
+        binary(t, OP_R_GREATER);
+        break;
+    case OP_GREATER_EQUAL:
+        binary(t, OP_R_GREATER_EQUAL);
+        break;
+    case OP_LESS_EQUAL:
+        binary(t, OP_R_LESS_EQUAL);
+        break;
+    case OP_LESS:
+        // A comparison that only feeds a conditional jump doesn't need to
+        // store its result.
+        if (next < (int)t->in->count && code[next] == OP_POP_JUMP_IF_FALSE &&
+            !t->labels[next])
+        {
+            int a = REG(t, t->top - 2);
+            int b = REG(t, t->top - 1);
+            t->top -= 2;
+            materialize(t, 0, t->top);
+            emit_op(t, OP_R_JUMP_IF_NOT_LESS);
+            emit(t, a);
+            emit(t, b);
+            int jump = (code[next + 1] << 8) | code[next + 2];
+            emit_jump(t, next + 3 + jump);
+            return next + 3;
+        }
+        binary(t, OP_R_LESS);
+        break;
+    case OP_ADD_LOCALS:
+    {
+        int a = REG(t, code[offset + 1]);
+        int b = REG(t, code[offset + 2]);
+        emit_dest(t, OP_R_ADD, push(t));
+        emit(t, a);
+        emit(t, b);
+        break;
+    }
+    case OP_PRINT:
+        emit_op(t, OP_R_PRINT);
+        emit(t, REG(t, t->top - 1));
+        t->top--;
+        break;
+    case OP_POP:
+        t->top--;
+        break;
+    case OP_DUP:
+    {
+        int a       = REG(t, t->top - 1);
+        int p       = push(t);
+        t->alias[p] = a;
+        break;
+    }
+    case OP_DEFINE_GLOBAL:
+        emit_op(t, OP_R_DEFINE_GLOBAL);
+        emit(t, REG(t, t->top - 1));
+        emit(t, code[offset + 1]);
+        emit(t, code[offset + 2]);
+        t->top--;
+        break;
+    case OP_GET_GLOBAL:
+        emit_dest(t, OP_R_GET_GLOBAL, push(t));
+        emit(t, code[offset + 1]);
+        emit(t, code[offset + 2]);
+        break;
+    case OP_SET_GLOBAL:
+        emit_op(t, OP_R_SET_GLOBAL);
+        emit(t, REG(t, t->top - 1));
+        emit(t, code[offset + 1]);
+        emit(t, code[offset + 2]);
+        break;
+    case OP_GET_LOCAL:
+    {
+        int a       = REG(t, code[offset + 1]);
+        int p       = push(t);
+        t->alias[p] = a;
+        break;
+    }
+    case OP_SET_LOCAL:
+        set_local(t, code[offset + 1]);
+        break;
+    case OP_SET_LOCAL_POP:
+        set_local(t, code[offset + 1]);
+        t->top--;
+        break;
+    case OP_JUMP:
+    {
+        int jump = (code[offset + 1] << 8) | code[offset + 2];
+        materialize(t, 0, t->top);
+        emit_op(t, OP_R_JUMP);
+        emit_jump(t, next + jump);
+        t->reachable = false;
+        break;
+    }
+    case OP_JUMP_IF_FALSE:
+    {
+        int jump = (code[offset + 1] << 8) | code[offset + 2];
+        materialize(t, 0, t->top);
+        emit_op(t, OP_R_JUMP_IF_FALSE);
+        emit(t, t->top - 1);
+        emit_jump(t, next + jump);
+        break;
+    }
+    case OP_POP_JUMP_IF_FALSE:
+    {
+        int jump = (code[offset + 1] << 8) | code[offset + 2];
+        int a    = REG(t, t->top - 1);
+        t->top--;
+        materialize(t, 0, t->top);
+        emit_op(t, OP_R_JUMP_IF_FALSE);
+        emit(t, a);
+        emit_jump(t, next + jump);
+        break;
+    }
+    case OP_LESS_LOCAL_CONST_JUMP:
+    {
+        int jump = (code[offset + 3] << 8) | code[offset + 4];
+        int a    = REG(t, code[offset + 1]);
+        materialize(t, 0, t->top);
+        emit_op(t, OP_R_JUMP_IF_NOT_LESS_K);
+        emit(t, a);
+        emit(t, code[offset + 2]);
+        emit_jump(t, next + jump);
+        break;
+    }
+    case OP_LOOP:
+    {
+        int jump = (code[offset + 1] << 8) | code[offset + 2];
+        materialize(t, 0, t->top);
+        emit_op(t, OP_R_LOOP);
+        emit_jump(t, next - jump);
+        t->reachable = false;
+        break;
+    }
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    {
+        int arg_count = code[offset + 1];
+        int base      = t->top - arg_count - 1;
+        materialize(t, base, t->top);
+        emit_op(t, code[offset] == OP_TAIL_CALL ? OP_R_TAIL_CALL : OP_R_CALL);
+        emit(t, base);
+        emit(t, arg_count);
+        t->top = base;
+        push(t);
+        break;
+    }
+    case OP_BUILD_STRING:
+    {
+        int count = code[offset + 1];
+        int base  = t->top - count;
+        materialize(t, base, t->top);
+        t->top = base;
+        emit_dest(t, OP_R_BUILD_STRING, push(t));
+        emit(t, base);
+        emit(t, count);
+        break;
+    }
+    case OP_RETURN:
+        emit_op(t, OP_R_RETURN);
+        emit(t, REG(t, t->top - 1));
+        t->top--;
+        t->reachable = false;
+        break;
+    default:
+        t->ok = false;
+        break;
+    }
+
+    return next;
+}
+
+static void
+patch_jumps(Translator *t)
+{
+    for (int i = 0; i < t->fixup_count; i++)
+    {
+        Fixup *fixup = &t->fixups[i];
+        int end      = fixup->at + 2;
+        int target   = t->offsets[fixup->target];
+        int jump     = target >= end ? target - end : end - target;
+        if (jump > UINT16_MAX) t->ok = false;
+
+        t->out.code[fixup->at]     = (jump >> 8) & 0xff;
+        t->out.code[fixup->at + 1] = jump & 0xff;
+    }
+}
+
+bool
+QxlChunk_to_registers(QxlChunk *chunk, int slots, int *max_stack)
+{
+    int count    = chunk->count;
+    Translator t = {
+        .in          = chunk,
+        .labels      = QxlMem_Allocate(bool, count + 1),
+        .depths      = QxlMem_Allocate(int, count + 1),
+        .offsets     = QxlMem_Allocate(int, count + 1),
+        .fixups      = QxlMem_Allocate(Fixup, count),
+        .fixup_count = 0,
+        .top         = 0,
+        .max         = 0,
+        .last_dest   = -1,
+        .reachable   = true,
+        .ok          = true,
+    };
+    QxlChunk_init(&t.out);
+
+    for (int offset = 0; offset <= count; offset++)
+    {
+        t.labels[offset] = false;
+        t.depths[offset] = -1;
+    }
+
+    for (int offset = 0; offset < count;)
+    {
+        uint8_t op = chunk->code[offset];
+        int next   = offset + QxlChunk_instruction_length(op);
+        int jump   = 0;
+        switch (op)
+        {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_LESS_LOCAL_CONST_JUMP:
+            jump = (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+            t.labels[next + jump] = true;
+            break;
+        case OP_LOOP:
+            jump = (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+            t.labels[next - jump] = true;
+            break;
+        }
+        offset = next;
+    }
+
+    while (t.top < slots)
+    {
+        push(&t);
+    }
+
+    for (int offset = 0; offset < count && t.ok;)
+    {
+        if (t.labels[offset] && !t.reachable && t.depths[offset] != -1)
+        {
+            // Only reached by jumping, which left every value in its slot
+            t.top = t.depths[offset];
+            for (int p = 0; p < t.top; p++)
+            {
+                t.alias[p] = REAL;
+            }
+        }
+        else if (t.labels[offset])
+        {
+            // Every jump moved its copies into place before jumping, the
+            // fallthrough path has to do the same.
+            materialize(&t, 0, t.top);
+            if (t.depths[offset] == -1) t.depths[offset] = t.top;
+            if (t.depths[offset] != t.top) t.ok = false;
+        }
+
+        if (t.labels[offset])
+        {
+            t.last_dest = -1;
+            t.reachable = true;
+        }
+
+        t.offsets[offset] = t.out.count;
+        t.line            = chunk->lines[offset];
+        offset            = translate(&t, offset);
+    }
+    t.offsets[count] = t.out.count;
+
+    if (t.ok) patch_jumps(&t);
+
+    QxlMem_Free_Array(bool, t.labels, count + 1);
+    QxlMem_Free_Array(int, t.depths, count + 1);
+    QxlMem_Free_Array(int, t.offsets, count + 1);
+    QxlMem_Free_Array(Fixup, t.fixups, count);
+
+    if (!t.ok)
+    {
+        QxlChunk_free(&t.out);
+        return false;
+    }
+
+    QxlMem_Free_Array(uint8_t, chunk->code, chunk->cap);
+    QxlMem_Free_Array(int, chunk->lines, chunk->cap);
+    chunk->code  = t.out.code;
+    chunk->lines = t.out.lines;
+    chunk->count = t.out.count;
+    chunk->cap   = t.out.cap;
+    *max_stack   = t.max;
+    return true;
+}
@@ -217,15 +217,13 @@ skip_whitespace(Scanner *s)
     }
 }
 
-Scanner *
-scanner_init(const char *src)
+void
+scanner_init(Scanner *s, const char *src)
 {
-    Scanner *s    = calloc(1, sizeof(Scanner));
     s->current    = src;
     s->start      = src;
     s->line       = 1;
     s->num_parens = 0;
-    return s;
 }
 
 Token
@@ -0,0 +1,224 @@
+#include "include/slab.h"
+#include "include/memory.h"
+
+// Blocks on the free lists and the untouched part of the pages are poisoned
+// so that AddressSanitizer still catches use after free inside the slabs
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POISON(ptr, size) ASAN_POISON_MEMORY_REGION((ptr), (size))
+#define UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION((ptr), (size))
+#else
+#define POISON(ptr, size) ((void)(ptr), (void)(size))
+#define UNPOISON(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+#define SIZE_CLASS(size) (((size)-1) / QXL_SLAB_GRANULE)
+#define CLASS_SIZE(class) (((class) + 1) * QXL_SLAB_GRANULE)
+
+// Pages are aligned to their size, so a block finds its page by masking
+#define PAGE_OF(ptr)                                                           \
+    ((QxlSlabPage *)((uintptr_t)(ptr) & ~(uintptr_t)(QXL_SLAB_PAGE_SIZE - 1)))
+#define PAGE_HEADER                                                            \
+    ((sizeof(QxlSlabPage) + QXL_SLAB_GRANULE - 1) & ~(QXL_SLAB_GRANULE - 1))
+#define PAGE_IS_FULL(page, size)                                               \
+    ((page)->free == NULL && (page)->bump + (size) > QXL_SLAB_PAGE_SIZE)
+
+#define REGION_ALIGNMENT(s)                                                    \
+    ((s)->huge_pages ? QXL_SLAB_HUGE_PAGE_SIZE : QXL_SLAB_PAGE_SIZE)
+
+void
+QxlSlab_init(QxlSlabs *s, size_t region_size, bool huge_pages)
+{
+    memset(s, 0, sizeof(QxlSlabs));
+    region_size = region_size > 0 ? region_size : QXL_SLAB_REGION_SIZE;
+    s->huge_pages  = huge_pages;
+    s->region_size = (region_size + REGION_ALIGNMENT(s) - 1) &
+                     ~(size_t)(REGION_ALIGNMENT(s) - 1);
+}
+
+void
+QxlSlab_release(QxlSlabs *s)
+{
+    for (int i = 0; i < s->region_count; i++)
+    {
+        UNPOISON(s->regions[i], s->region_size + REGION_ALIGNMENT(s));
+        QxlMem_release(s->regions[i], s->region_size + REGION_ALIGNMENT(s));
+    }
+    free(s->regions);
+    QxlSlab_init(s, s->region_size, s->huge_pages);
+}
+
+static void
+push_page(QxlSlabPage **list, QxlSlabPage *page)
+{
+    page->prev = NULL;
+    page->next = *list;
+    if (*list != NULL) (*list)->prev = page;
+    *list = page;
+}
+
+static void
+unlink_page(QxlSlabPage **list, QxlSlabPage *page)
+{
+    if (page->prev != NULL)
+    {
+        page->prev->next = page->next;
+    }
+    else
+    {
+        *list = page->next;
+    }
+    if (page->next != NULL) page->next->prev = page->prev;
+}
+
+static bool
+new_region(QxlSlabs *s)
+{
+    // Reserved with room to align the start, only the pages touched later
+    // are backed by memory
+    size_t alignment = REGION_ALIGNMENT(s);
+    uint8_t **regions =
+        realloc(s->regions, sizeof(uint8_t *) * (s->region_count + 1));
+    if (regions == NULL) return false;
+    s->regions = regions;
+
+    uint8_t *region = QxlMem_reserve(s->region_size + alignment);
+    s->regions[s->region_count++] = region;
+
+    s->bump = (uint8_t *)(((uintptr_t)region + alignment - 1) &
+                          ~(uintptr_t)(alignment - 1));
+    s->bump_end = s->bump + s->region_size;
+    if (s->huge_pages) QxlMem_advise_huge_pages(s->bump, s->region_size);
+    POISON(s->bump, s->region_size);
+    return true;
+}
+
+// Returns a page without live blocks, preferring ones that are still backed
+static QxlSlabPage *
+take_page(QxlSlabs *s)
+{
+    QxlSlabPage *page = s->empty;
+    if (page != NULL)
+    {
+        unlink_page(&s->empty, page);
+        s->empty_count--;
+        return page;
+    }
+
+    page = s->discarded;
+    if (page != NULL)
+    {
+        unlink_page(&s->discarded, page);
+        return page;
+    }
+
+    if (s->bump == s->bump_end && !new_region(s)) return NULL;
+    page = (QxlSlabPage *)s->bump;
+    s->bump += QXL_SLAB_PAGE_SIZE;
+    UNPOISON(page, PAGE_HEADER);
+    return page;
+}
+
+// Keeps a few pages without live blocks for reuse, the memory of the others
+// goes back to the OS. Their headers stay so they can still be listed.
+static void
+give_back_page(QxlSlabs *s, QxlSlabPage *page)
+{
+    if (s->empty_count < QXL_SLAB_EMPTY_MAX)
+    {
+        push_page(&s->empty, page);
+        s->empty_count++;
+        return;
+    }
+
+    QxlMem_discard((uint8_t *)page + PAGE_HEADER,
+                   QXL_SLAB_PAGE_SIZE - PAGE_HEADER);
+    push_page(&s->discarded, page);
+    s->pages_discarded++;
+}
+
+static void *
+slab_allocate(QxlSlabs *s, int class)
+{
+    size_t size       = CLASS_SIZE(class);
+    QxlSlabPage *page = s->partial[class];
+    if (page == NULL)
+    {
+        page = take_page(s);
+        if (page == NULL) return NULL;
+        page->free       = NULL;
+        page->bump       = PAGE_HEADER;
+        page->live       = 0;
+        page->size_class = class;
+        push_page(&s->partial[class], page);
+    }
+
+    QxlSlabBlock *block = page->free;
+    if (block != NULL)
+    {
+        UNPOISON(block, size);
+        page->free = block->next;
+    }
+    else
+    {
+        block = (QxlSlabBlock *)((uint8_t *)page + page->bump);
+        page->bump += size;
+        UNPOISON(block, size);
+    }
+
+    page->live++;
+    if (PAGE_IS_FULL(page, size)) unlink_page(&s->partial[class], page);
+    return block;
+}
+
+static void
+slab_free(QxlSlabs *s, void *ptr, int class)
+{
+    size_t size         = CLASS_SIZE(class);
+    QxlSlabPage *page   = PAGE_OF(ptr);
+    bool was_full       = PAGE_IS_FULL(page, size);
+    QxlSlabBlock *block = ptr;
+    block->next         = page->free;
+    page->free          = block;
+    POISON(block, size);
+
+    page->live--;
+    if (was_full) push_page(&s->partial[class], page);
+    if (page->live == 0)
+    {
+        unlink_page(&s->partial[class], page);
+        POISON((uint8_t *)page + PAGE_HEADER, QXL_SLAB_PAGE_SIZE - PAGE_HEADER);
+        give_back_page(s, page);
+    }
+}
+
+void *
+QxlSlab_reallocate(QxlSlabs *s, void *ptr, size_t size, size_t new_size)
+{
+    bool was_slab = ptr != NULL && QxlSlab_fits(size);
+    if (was_slab && QxlSlab_fits(new_size) &&
+        SIZE_CLASS(size) == SIZE_CLASS(new_size))
+    {
+        return ptr;
+    }
+
+    void *result = NULL;
+    if (new_size > 0)
+    {
+        result = QxlSlab_fits(new_size)
+                     ? slab_allocate(s, SIZE_CLASS(new_size))
+                     : malloc(new_size);
+        if (result == NULL) return NULL;
+        if (ptr != NULL) memcpy(result, ptr, size < new_size ? size : new_size);
+    }
+
+    if (was_slab)
+    {
+        slab_free(s, ptr, SIZE_CLASS(size));
+    }
+    else
+    {
+        free(ptr);
+    }
+    return result;
+}
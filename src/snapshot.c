@@ -0,0 +1,331 @@
+#include "include/snapshot.h"
+#include "include/memory.h"
+#include "include/object.h"
+
+#include <limits.h>
+
+// Allocation lines the diff lists, the ones that changed the most first
+#define SNAPSHOT_DIFF_LINES 20
+
+static size_t
+object_size(QxlObject *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_STRING:
+        return QxlString_Size(((QxlString *)obj)->length);
+    case OBJ_FUNCTION:
+    {
+        QxlChunk *chunk = &((QxlFunction *)obj)->chunk;
+        return sizeof(QxlFunction) +
+               chunk->cap * (sizeof(uint8_t) + sizeof(int)) +
+               chunk->constants.cap * sizeof(QxlValue);
+    }
+    case OBJ_BUILTIN:
+        return sizeof(QxlBuiltin);
+    case OBJ_ROPE:
+        return sizeof(QxlRope);
+    }
+    return 0;
+}
+
+static void
+write_reference(FILE *out, QxlObject *obj)
+{
+    if (obj != NULL) fprintf(out, " %p", (void *)obj);
+}
+
+static void
+write_object(FILE *out, QxlObject *obj)
+{
+    fprintf(out, "object %p %s %zu %u", (void *)obj,
+            QxlObject_type_names[obj->type], object_size(obj), obj->line);
+
+    switch (obj->type)
+    {
+    case OBJ_FUNCTION:
+    {
+        QxlFunction *fn = (QxlFunction *)obj;
+        write_reference(out, (QxlObject *)fn->name);
+        for (size_t i = 0; i < fn->chunk.constants.count; i++)
+        {
+            QxlValue constant = fn->chunk.constants.values[i];
+            if (IS_OBJECT(constant)) write_reference(out, AS_OBJECT(constant));
+        }
+        break;
+    }
+    case OBJ_BUILTIN:
+        write_reference(out, (QxlObject *)((QxlBuiltin *)obj)->name);
+        break;
+    case OBJ_ROPE:
+    {
+        QxlRope *rope = (QxlRope *)obj;
+        write_reference(out, rope->left);
+        write_reference(out, rope->right);
+        write_reference(out, (QxlObject *)rope->flat);
+        break;
+    }
+    case OBJ_STRING:
+        break;
+    }
+
+    fputc('\n', out);
+}
+
+// Young strings are not on the object list, only the ones a root reaches are
+// alive. They are written the first time they are seen and marked so they
+// are written once.
+static void
+write_root(VM *vm, FILE *out, const char *kind, const char *label,
+           QxlValue value)
+{
+    if (!IS_OBJECT(value)) return;
+
+    QxlObject *obj = AS_OBJECT(value);
+    fprintf(out, "root %s %s %p\n", kind, label, (void *)obj);
+    if (VM_IS_YOUNG(vm, obj) && !obj->is_marked)
+    {
+        obj->is_marked = true;
+        write_object(out, obj);
+    }
+}
+
+static void
+write_slot_root(VM *vm, FILE *out, const char *kind, long slot, QxlValue value)
+{
+    char label[32];
+    snprintf(label, sizeof(label), "%ld", slot);
+    write_root(vm, out, kind, label, value);
+}
+
+bool
+QxlSnapshot_write(VM *vm, FILE *out)
+{
+    VM *previous = QxlMem_attach(vm);
+    QxlMem_collect_garbage(vm);
+    QxlMem_attach(previous);
+    fprintf(out, "%s\n", QXL_SNAPSHOT_HEADER);
+
+    for (QxlValue *slot = vm->stack; slot < vm->stack_top; slot++)
+    {
+        write_slot_root(vm, out, "stack", slot - vm->stack, *slot);
+    }
+
+    for (int i = 0; i < vm->frame_count; i++)
+    {
+        CallFrame *frame = &vm->frames[i];
+        write_slot_root(vm, out, "frame", i, OBJECT_VAL(frame->fn));
+
+        // Registers of a frame that called out can be above the stack top
+        if (vm->register_mode)
+        {
+            for (int r = 0; r < frame->fn->max_stack; r++)
+            {
+                if (frame->slots + r < vm->stack_top) continue;
+                write_slot_root(vm, out, "stack", frame->slots + r - vm->stack,
+                                frame->slots[r]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < vm->global_values.count; i++)
+    {
+        write_root(vm, out, "global", AS_CSTRING(vm->global_names.values[i]),
+                   vm->global_values.values[i]);
+    }
+
+    for (QxlObject *obj = vm->objects; obj != NULL; obj = obj->next)
+    {
+        write_object(out, obj);
+    }
+
+    for (uint8_t *young = vm->nursery; young < vm->nursery_top;)
+    {
+        QxlString *string     = (QxlString *)young;
+        string->obj.is_marked = false;
+        young += VM_NURSERY_ALIGN(QxlString_Size(string->length));
+    }
+
+    fflush(out);
+    return !ferror(out);
+}
+
+typedef struct
+{
+    size_t count;
+    size_t bytes;
+} Usage;
+
+typedef struct
+{
+    Usage types[OBJ_TYPE_COUNT];
+    Usage *lines; // by allocation line and then type
+    size_t line_count;
+} Summary;
+
+// Adds up the objects of a snapshot file one record at a time
+static bool
+read_summary(const char *path, Summary *summary)
+{
+    memset(summary, 0, sizeof(Summary));
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return false;
+
+    char header[sizeof(QXL_SNAPSHOT_HEADER) + 1];
+    bool ok = fgets(header, sizeof(header), file) != NULL &&
+              strncmp(header, QXL_SNAPSHOT_HEADER,
+                      sizeof(QXL_SNAPSHOT_HEADER) - 1) == 0;
+
+    char kind[16];
+    while (ok && fscanf(file, "%15s", kind) == 1)
+    {
+        if (strcmp(kind, "object") == 0)
+        {
+            char type_name[32];
+            size_t bytes;
+            unsigned line;
+            if (fscanf(file, "%*s %31s %zu %u", type_name, &bytes, &line) != 3)
+            {
+                ok = false;
+                break;
+            }
+
+            int type = 0;
+            while (type < OBJ_TYPE_COUNT &&
+                   strcmp(type_name, QxlObject_type_names[type]) != 0)
+            {
+                type++;
+            }
+            if (type == OBJ_TYPE_COUNT || line > INT_MAX)
+            {
+                ok = false;
+                break;
+            }
+
+            if (line >= summary->line_count)
+            {
+                size_t lines = (size_t)line + 1 > summary->line_count * 2
+                                   ? (size_t)line + 1
+                                   : summary->line_count * 2;
+                Usage *grown   = (Usage *)realloc(
+                    summary->lines, sizeof(Usage) * lines * OBJ_TYPE_COUNT);
+                if (grown == NULL)
+                {
+                    ok = false;
+                    break;
+                }
+                memset(grown + summary->line_count * OBJ_TYPE_COUNT, 0,
+                       sizeof(Usage) * (lines - summary->line_count) *
+                           OBJ_TYPE_COUNT);
+                summary->lines      = grown;
+                summary->line_count = lines;
+            }
+
+            Usage *site = &summary->lines[(size_t)line * OBJ_TYPE_COUNT + type];
+            summary->types[type].count++;
+            summary->types[type].bytes += bytes;
+            site->count++;
+            site->bytes += bytes;
+        }
+
+        // The references of an object and the roots are not summarized
+        fscanf(file, "%*[^\n]");
+    }
+
+    ok = ok && !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+static Usage
+summary_line(Summary *summary, unsigned line, int type)
+{
+    Usage none = {0, 0};
+    return line < summary->line_count
+               ? summary->lines[(size_t)line * OBJ_TYPE_COUNT + type]
+               : none;
+}
+
+typedef struct
+{
+    unsigned line;
+    int type;
+    long count;
+    long bytes;
+} Growth;
+
+static int
+compare_growth(const void *a, const void *b)
+{
+    long x = ((const Growth *)a)->bytes;
+    long y = ((const Growth *)b)->bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+bool
+QxlSnapshot_diff(const char *before, const char *after, FILE *out)
+{
+    Summary a, b;
+    if (!read_summary(before, &a))
+    {
+        free(a.lines);
+        return false;
+    }
+    if (!read_summary(after, &b))
+    {
+        free(a.lines);
+        free(b.lines);
+        return false;
+    }
+
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+    {
+        fprintf(out, "%-10s %+8ld objects %+10ld bytes (%zu -> %zu bytes)\n",
+                QxlObject_type_names[type],
+                (long)b.types[type].count - (long)a.types[type].count,
+                (long)b.types[type].bytes - (long)a.types[type].bytes,
+                a.types[type].bytes, b.types[type].bytes);
+    }
+
+    size_t lines = a.line_count > b.line_count ? a.line_count : b.line_count;
+    Growth *growth =
+        (Growth *)malloc(sizeof(Growth) * (lines * OBJ_TYPE_COUNT + 1));
+    if (growth == NULL) exit(1);
+
+    size_t count = 0;
+    for (unsigned line = 0; line < lines; line++)
+    {
+        for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+        {
+            Usage x = summary_line(&a, line, type);
+            Usage y = summary_line(&b, line, type);
+            if (x.count == y.count && x.bytes == y.bytes) continue;
+
+            growth[count++] =
+                (Growth){line, type, (long)y.count - (long)x.count,
+                         (long)y.bytes - (long)x.bytes};
+        }
+    }
+    qsort(growth, count, sizeof(Growth), compare_growth);
+
+    fprintf(out, "\nby allocation line\n");
+    for (size_t i = 0; i < count && i < SNAPSHOT_DIFF_LINES; i++)
+    {
+        if (growth[i].line == 0)
+        {
+            fprintf(out, "<outside> ");
+        }
+        else
+        {
+            fprintf(out, "line %-5u ", growth[i].line);
+        }
+        fprintf(out, "%-10s %+8ld objects %+10ld bytes\n",
+                QxlObject_type_names[growth[i].type], growth[i].count,
+                growth[i].bytes);
+    }
+
+    free(growth);
+    free(a.lines);
+    free(b.lines);
+    return true;
+}
@@ -1,5 +1,6 @@
 #include "include/value.h"
 #include "include/memory.h"
+#include "include/number.h"
 #include "include/object.h"
 #include "include/quixil.h"
 
@@ -16,10 +17,10 @@ QxlValueList_push(QxlValueList *list, QxlValue value)
 {
     if (list->cap < list->count + 1)
     {
-        size_t old_cap = list->cap;
-        list->cap      = QxlMem_Resize(old_cap);
-        list->values =
-            QxlMem_Realloc(QxlValue, list->values, old_cap, list->cap);
+        // The capacity is only updated once the growth cannot fail anymore
+        size_t cap   = QxlMem_Resize(list->cap);
+        list->values = QxlMem_Realloc(QxlValue, list->values, list->cap, cap);
+        list->cap    = cap;
     }
 
     list->values[list->count] = value;
@@ -36,26 +37,43 @@ QxlValueList_free(QxlValueList *list)
 void
 QxlValue_print(QxlValue value)
 {
-    switch (value.type)
+    if (IS_BOOL(value))
     {
-    case VAL_BOOL:
         printf(AS_BOOL(value) ? "true" : "false");
-        break;
-    case VAL_NIL:
+    }
+    else if (IS_NIL(value))
+    {
         printf("nil");
-        break;
-    case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
-        break;
-    case VAL_OBJECT:
+    }
+    else if (IS_NUMBER(value))
+    {
+        char chars[QXL_NUM_CHARS_MAX];
+        fwrite(chars, 1, Qxl_num_format(chars, AS_NUMBER(value)), stdout);
+    }
+    else if (IS_OBJECT(value))
+    {
         QxlObject_print(value);
-        break;
     }
 }
 
+// Interned strings are equal only when they are the same object, but young
+// strings and ropes are not interned and have to be compared by their chars
+static bool
+strings_equal(QxlValue a, QxlValue b)
+{
+    return IS_ANY_STRING(a) && IS_ANY_STRING(b) &&
+           QxlString_equals(AS_OBJECT(a), AS_OBJECT(b));
+}
+
 bool
 QxlValue_are_equal(QxlValue a, QxlValue b)
 {
+#ifdef NAN_BOXING
+    // Compare numbers as doubles so that NaN != NaN and 0 == -0
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    if (a == b) return true;
+    return strings_equal(a, b);
+#else
     if (a.type != b.type) return false;
     switch (a.type)
     {
@@ -66,8 +84,20 @@ QxlValue_are_equal(QxlValue a, QxlValue b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJECT:
-        return AS_OBJECT(a) == AS_OBJECT(b);
+        if (AS_OBJECT(a) == AS_OBJECT(b)) return true;
+        return strings_equal(a, b);
     default:
         return false; // Unreachable
     }
-}
\ No newline at end of file
+#endif
+}
+
+const char *
+QxlValue_type_name(QxlValue value)
+{
+    if (IS_BOOL(value)) return "bool";
+    if (IS_NIL(value)) return "nil";
+    if (IS_NUMBER(value)) return "number";
+    if (IS_ROPE(value)) return QxlObject_type_names[OBJ_STRING];
+    return QxlObject_type_names[OBJECT_TYPE(value)];
+}
@@ -5,11 +5,18 @@
 #include "include/common.h"
 #include "include/compiler.h"
 #include "include/debug.h"
+#include "include/image.h"
 #include "include/memory.h"
+#include "include/number.h"
 #include "include/object.h"
 #include "include/quixil.h"
 #include "include/scanner.h"
 
+#ifndef _WIN32
+#include <limits.h>
+#include <sys/resource.h>
+#endif
+
 #define STACK_PEEK(d) vm->stack_top[-1 - (d)]
 
 static bool
@@ -25,14 +32,27 @@ vm_stack_reset(VM *vm)
     vm->frame_count = 0;
 }
 
+// Returns the line of the last instruction a frame ran. A frame that has not
+// stored its instruction pointer since it started reports its first line.
+static int
+frame_line(CallFrame *frame)
+{
+    QxlChunk *chunk = &frame->fn->chunk;
+    return chunk->lines[frame->ip > chunk->code ? frame->ip - chunk->code - 1
+                                                : 0];
+}
+
+int
+vm_current_line(VM *vm)
+{
+    return vm->frame_count > 0 ? frame_line(&vm->frames[vm->frame_count - 1])
+                               : 0;
+}
+
 static void
 runtime_error(VM *vm, const char *format, ...)
 {
-    CallFrame *frame = &vm->frames[vm->frame_count - 1];
-
-    size_t instruction = frame->ip - frame->fn->chunk.code - 1;
-    int line           = frame->fn->chunk.lines[instruction];
-    Qxl_ERROR("[Line %d] ", line);
+    Qxl_ERROR("[Line %d] ", frame_line(&vm->frames[vm->frame_count - 1]));
 
     va_list args;
     va_start(args, format);
@@ -42,10 +62,17 @@ runtime_error(VM *vm, const char *format, ...)
 
     for (int i = vm->frame_count - 1; i >= 0; i--)
     {
-        CallFrame *frame   = &vm->frames[i];
-        QxlFunction *fn    = frame->fn;
-        size_t instruction = frame->ip - fn->chunk.code - 1;
-        fprintf(stderr, "[Line %d] in ", fn->chunk.lines[instruction]);
+        // Deep recursion would print every frame, keep both ends of it
+        int omitted = vm->frame_count - VM_TRACEBACK_MAX;
+        if (omitted > 0 && i == vm->frame_count - VM_TRACEBACK_MAX / 2 - 1)
+        {
+            fprintf(stderr, "[...] %d more calls\n", omitted);
+            i -= omitted - 1;
+            continue;
+        }
+
+        QxlFunction *fn = vm->frames[i].fn;
+        fprintf(stderr, "[Line %d] in ", frame_line(&vm->frames[i]));
         if (fn->name == NULL)
         {
             fprintf(stderr, "<script-main>\n");
@@ -60,30 +87,177 @@ runtime_error(VM *vm, const char *format, ...)
 }
 
 VM *
-vm_init()
+vm_init(const QxlVMOptions *options)
 {
-    VM *vm = calloc(1, sizeof(VM));
+    VM *vm      = calloc(1, sizeof(VM));
+    vm->next_gc = VM_GC_INITIAL;
+    vm->max_bytes =
+        options != NULL && options->max_bytes > 0 ? options->max_bytes
+                                                  : SIZE_MAX;
+    vm->allocator = options != NULL ? options->allocator : NULL;
+#ifdef SLAB_ALLOCATOR
+    QxlSlab_init(&vm->slabs, options != NULL ? options->heap_region : 0,
+                 options != NULL && options->huge_pages);
+#endif
+    vm->stack   = QxlMem_reserve(sizeof(QxlValue) * VM_STACK_MAX);
+    vm->nursery = vm->nursery_top = QxlMem_reserve(VM_NURSERY_SIZE);
     vm_stack_reset(vm);
-    vm->objects = NULL;
+    VM *previous = QxlMem_attach(vm);
+
+    vm->frames    = QxlMem_Allocate(CallFrame, VM_FRAMES_INIT);
+    vm->frame_cap = VM_FRAMES_INIT;
+    vm->objects   = NULL;
     QxlHashTable_init(&vm->strings);
     QxlHashTable_init(&vm->globals);
+    QxlValueList_init(&vm->global_values);
+    QxlValueList_init(&vm->global_names);
 
-    // Load builtins
-    builtins_init(vm);
+    // Load builtins, unless the image has them
+    if (options != NULL && options->image != NULL)
+    {
+        if (!QxlImage_load(vm, options->image))
+        {
+            vm_free(vm);
+            QxlMem_attach(previous);
+            return NULL;
+        }
+    }
+    else
+    {
+        builtins_init(vm);
+    }
+
+#ifdef DEBUG_TRACK_ALLOCATIONS
+    static bool reporting = false;
+    if (!reporting) atexit(debug_allocations_report);
+    reporting = true;
+#endif
 
+    QxlMem_attach(previous);
     return vm;
 }
 
 void
 vm_free(VM *vm)
 {
+    VM *previous = QxlMem_attach(vm);
+    free(vm->gray_stack);
+    QxlMem_Free_Array(int, vm->remembered, vm->remembered_cap);
     QxlHashTable_free(&vm->strings);
     QxlHashTable_free(&vm->globals);
+    QxlValueList_free(&vm->global_values);
+    QxlValueList_free(&vm->global_names);
     QxlMem_free_objects(vm);
+    QxlMem_Free_Array(CallFrame, vm->frames, vm->frame_cap);
+    QxlMem_release(vm->stack, sizeof(QxlValue) * VM_STACK_MAX);
+    QxlMem_release(vm->nursery, VM_NURSERY_SIZE);
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+    free(vm->sampled_bytes);
+#endif
+    // The frees above go back to the slabs, so detach only now
+    QxlMem_attach(previous == vm ? NULL : previous);
+#ifdef SLAB_ALLOCATOR
+    QxlSlab_release(&vm->slabs);
+#endif
+    QxlImage_unload(vm);
+    free(vm);
+}
+
+QxlHeapStats
+vm_heap_stats(VM *vm)
+{
+    // The reachable young strings are moved to the old space first, so
+    // the nursery ends up empty and everything left is on the object list
+    VM *previous = QxlMem_attach(vm);
+    QxlMem_collect_nursery(vm);
+    QxlMem_collect_garbage(vm);
+    QxlMem_attach(previous);
+
+    QxlHeapStats stats = {
+        .strings_count   = vm->strings.count,
+        .strings_cap     = vm->strings.cap,
+        .globals_count   = vm->globals.count,
+        .globals_cap     = vm->globals.cap,
+        .bytes_allocated = vm->bytes_allocated,
+        .image_bytes     = vm->image_size,
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+        .sampled_bytes = vm->sampled_bytes,
+        .sampled_lines = vm->sampled_lines,
+#endif
+    };
+
+    for (QxlObject *obj = vm->objects; obj != NULL; obj = obj->next)
+    {
+        size_t size = 0;
+        switch (obj->type)
+        {
+        case OBJ_STRING:
+            size = QxlString_Size(((QxlString *)obj)->length);
+            break;
+        case OBJ_FUNCTION:
+        {
+            QxlChunk *chunk = &((QxlFunction *)obj)->chunk;
+            size            = sizeof(QxlFunction);
+            stats.code_bytes += chunk->cap * sizeof(uint8_t);
+            stats.line_bytes += chunk->cap * sizeof(int);
+            stats.constant_bytes += chunk->constants.cap * sizeof(QxlValue);
+            break;
+        }
+        case OBJ_BUILTIN:
+            size = sizeof(QxlBuiltin);
+            break;
+        case OBJ_ROPE:
+            size = sizeof(QxlRope);
+            break;
+        }
+        stats.objects[obj->type]++;
+        stats.object_bytes[obj->type] += size;
+    }
+
+#ifdef SLAB_ALLOCATOR
+    QxlSlabs *slabs = &vm->slabs;
+    stats.slab_pages =
+        (slabs->region_count * slabs->region_size -
+         (size_t)(slabs->bump_end - slabs->bump)) / QXL_SLAB_PAGE_SIZE;
+    stats.slab_pages_discarded = slabs->pages_discarded;
+#endif
+
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        stats.minor_faults = usage.ru_minflt;
+        stats.major_faults = usage.ru_majflt;
+    }
+#endif
+
+    return stats;
 }
 
+// Returns the index of the slot holding global `name`, creating an undefined
+// one the first time the name is seen. The compiler resolves every global
+// through here, so the VM only ever indexes `global_values`.
+int
+vm_global_slot(VM *vm, QxlString *name)
+{
+    QxlValue index;
+    if (QxlHashTable_get(&vm->globals, name, &index))
+    {
+        return (int)AS_NUMBER(index);
+    }
+
+    int slot = vm->global_values.count;
+    vm_stack_push(vm, OBJECT_VAL(name));
+    QxlValueList_push(&vm->global_values, UNDEFINED_VAL);
+    QxlValueList_push(&vm->global_names, OBJECT_VAL(name));
+    QxlHashTable_put(&vm->globals, name, NUMBER_VAL(slot));
+    vm_stack_pop(vm);
+    return slot;
+}
+
+// Checks that `fn` can be entered with its frame starting at `slots`
 static bool
-call(VM *vm, QxlFunction *fn, int arg_count)
+can_call(VM *vm, QxlFunction *fn, int arg_count, QxlValue *slots)
 {
     if (arg_count != fn->arity)
     {
@@ -92,47 +266,149 @@ call(VM *vm, QxlFunction *fn, int arg_count)
         return false;
     }
 
-    if (vm->frame_count == VM_FRAMES_MAX)
+    // The compiler knows how deep each function can go, so this is the only
+    // overflow check the stack needs.
+    if (slots + fn->max_stack + VM_STACK_SLACK > vm->stack + VM_STACK_MAX)
     {
         runtime_error(vm, "Stack overflow");
         return false;
     }
 
+    return true;
+}
+
+static bool
+call(VM *vm, QxlFunction *fn, int arg_count)
+{
+    QxlValue *slots = vm->stack_top - arg_count - 1;
+    if (!can_call(vm, fn, arg_count, slots)) return false;
+
+    if (vm->frame_count == vm->frame_cap)
+    {
+        // The capacity is only updated once the growth cannot fail anymore
+        int cap = QxlMem_Resize(vm->frame_cap);
+        vm->frames =
+            QxlMem_Realloc(CallFrame, vm->frames, vm->frame_cap, cap);
+        vm->frame_cap = cap;
+    }
+
     CallFrame *frame = &vm->frames[vm->frame_count++];
     frame->fn        = fn;
     frame->ip        = fn->chunk.code;
-    frame->slots     = vm->stack_top - arg_count - 1;
+    frame->slots     = slots;
+    return true;
+}
+
+// Replaces the running frame with a call to `fn`. The callee and its
+// arguments are moved down over the slots of the function being left.
+static bool
+tail_call(VM *vm, QxlFunction *fn, int arg_count)
+{
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    if (!can_call(vm, fn, arg_count, frame->slots)) return false;
+
+    memmove(frame->slots, vm->stack_top - arg_count - 1,
+            sizeof(QxlValue) * (arg_count + 1));
+    vm->stack_top = frame->slots + arg_count + 1;
+    frame->fn     = fn;
+    frame->ip     = fn->chunk.code;
+    return true;
+}
+
+static const char *arg_type_names[] = {
+    [ARG_ANY]    = "any",
+    [ARG_NUMBER] = "number",
+    [ARG_STRING] = "str",
+    [ARG_BOOL]   = "bool",
+};
+
+static bool
+arg_has_type(QxlValue value, QxlArgType type)
+{
+    switch (type)
+    {
+    case ARG_NUMBER:
+        return IS_NUMBER(value);
+    case ARG_STRING:
+        return IS_ANY_STRING(value);
+    case ARG_BOOL:
+        return IS_BOOL(value);
+    default:
+        return true;
+    }
+}
+
+// Calls a builtin with the `arg_count` values on top of the stack after
+// checking them against its signature. The callee and the arguments are
+// replaced by the result.
+static bool
+call_builtin(VM *vm, QxlBuiltin *bltin, int arg_count)
+{
+    const QxlBuiltinDef *def = bltin->def;
+    QxlValue *args           = vm->stack_top - arg_count;
+
+    if (arg_count < def->min_arity || arg_count > def->arity)
+    {
+        if (def->min_arity == def->arity)
+        {
+            runtime_error(vm, "%s() takes exactly %d arguments (%d given)",
+                          def->name, def->arity, arg_count);
+        }
+        else
+        {
+            runtime_error(vm, "%s() takes %d to %d arguments (%d given)",
+                          def->name, def->min_arity, def->arity, arg_count);
+        }
+        return false;
+    }
+
+    for (int i = 0; i < arg_count; i++)
+    {
+        if (!arg_has_type(args[i], def->types[i]))
+        {
+            runtime_error(vm, "%s() argument %d must be %s, not %s", def->name,
+                          i + 1, arg_type_names[def->types[i]],
+                          QxlValue_type_name(args[i]));
+            return false;
+        }
+    }
+
+    // Builtins read the chars of their string arguments directly
+    for (int i = 0; i < arg_count; i++)
+    {
+        if (IS_ROPE(args[i]))
+        {
+            args[i] = OBJECT_VAL(QxlString_flatten(vm, AS_OBJECT(args[i])));
+        }
+    }
+
+    QxlValue result = def->fn(vm, arg_count, args);
+    if (IS_UNDEFINED(result))
+    {
+        runtime_error(vm, "%s(): %s", def->name, vm->builtin_error);
+        return false;
+    }
+
+    vm->stack_top = args;
+    args[-1]      = result;
     return true;
 }
 
+// Calls `callee` with the `arg_count` values on top of the stack. A tail call
+// to a function reuses the running frame, builtins return their result in
+// place either way and leave the OP_RETURN that follows to return it.
 static bool
-call_value(VM *vm, QxlValue callee, int arg_count)
+call_value(VM *vm, QxlValue callee, int arg_count, bool tail)
 {
     if (IS_OBJECT(callee))
     {
         switch (OBJECT_TYPE(callee))
         {
         case OBJ_FUNCTION:
-            return call(vm, AS_FUNCTION(callee), arg_count);
+            return tail ? tail_call(vm, AS_FUNCTION(callee), arg_count)
+                        : call(vm, AS_FUNCTION(callee), arg_count);
         case OBJ_BUILTIN:
-        {
-            BuiltinFn bltin = AS_BUILTIN_FUNCTION(callee);
-            if (bltin(vm, arg_count, vm->stack_top - arg_count))
-            {
-                vm->stack_top -= arg_count;
-                return true;
-            }
-            else
-            {
-                runtime_error(vm,
-                              AS_STRING(vm->stack_top[-arg_count - 1])->chars);
-                return false;
-            }
-
-            // QxlValue result = bltin(vm, arg_count, vm->stack_top -
-            // arg_count); vm->stack_top -= arg_count + 1; vm_stack_push(vm,
-            // result); return true;
-        }
+            return call_builtin(vm, AS_BUILTIN(callee), arg_count);
         default:
             break; // Non-callable object type
         }
@@ -141,16 +417,236 @@ call_value(VM *vm, QxlValue callee, int arg_count)
     return false;
 }
 
+// Adds the two values on top of the stack, concatenating if either of them is
+// a string.
+static bool
+add_values(VM *vm)
+{
+    if (IS_NUMBER(STACK_PEEK(0)) && IS_NUMBER(STACK_PEEK(1)))
+    {
+        double b = AS_NUMBER(vm_stack_pop(vm));
+        double a = AS_NUMBER(vm_stack_pop(vm));
+        vm_stack_push(vm, NUMBER_VAL(a + b));
+    }
+    else if ((IS_ANY_STRING(STACK_PEEK(0)) && IS_NUMBER(STACK_PEEK(1))) ||
+             (IS_NUMBER(STACK_PEEK(0)) && IS_ANY_STRING(STACK_PEEK(1))))
+    {
+        // The number is replaced by its string in place so the stack keeps
+        // it alive while the result is allocated
+        int num = IS_NUMBER(STACK_PEEK(0)) ? 0 : 1;
+        STACK_PEEK(num) =
+            OBJECT_VAL(QxlString_from_number(vm, AS_NUMBER(STACK_PEEK(num))));
+        return add_values(vm);
+    }
+    else if (IS_ANY_STRING(STACK_PEEK(0)) && IS_ANY_STRING(STACK_PEEK(1)))
+    {
+        // Both operands stay on the stack until the result exists, allocating
+        // it can collect. Long results are ropes made in constant time.
+        QxlObject *str = QxlString_join(vm, AS_OBJECT(STACK_PEEK(1)),
+                                        AS_OBJECT(STACK_PEEK(0)));
+        if (str == NULL)
+        {
+            runtime_error(vm, "RuntimeError: String is too long");
+            return false;
+        }
+        vm->stack_top -= 2;
+        vm_stack_push(vm, OBJECT_VAL(str));
+    }
+    else if (IS_ANY_STRING(STACK_PEEK(0)) || IS_ANY_STRING(STACK_PEEK(1)))
+    {
+        runtime_error(
+            vm, "RuntimeError: Can only concatenate str (not '%s') to str",
+            Qxl_TYPE_NAME(STACK_PEEK(IS_ANY_STRING(STACK_PEEK(0)) ? 1 : 0)));
+        return false;
+    }
+    else
+    {
+        runtime_error(vm,
+                      "RuntimeError: Unsupported operand types(s) for + : "
+                      "'%s' and '%s'",
+                      Qxl_TYPE_NAME(STACK_PEEK(1)),
+                      Qxl_TYPE_NAME(STACK_PEEK(0)));
+        return false;
+    }
+
+    return true;
+}
+
+// Multiplies the two values on top of the stack, repeating the string if
+// either of them is a string.
+static bool
+multiply_values(VM *vm)
+{
+    if (IS_NUMBER(STACK_PEEK(0)) && IS_NUMBER(STACK_PEEK(1)))
+    {
+        double b = AS_NUMBER(vm_stack_pop(vm));
+        double a = AS_NUMBER(vm_stack_pop(vm));
+        vm_stack_push(vm, NUMBER_VAL(a * b));
+    }
+    else if ((IS_ANY_STRING(STACK_PEEK(0)) && IS_NUMBER(STACK_PEEK(1))) ||
+             (IS_NUMBER(STACK_PEEK(0)) && IS_ANY_STRING(STACK_PEEK(1))))
+    {
+        // A rope is flattened in place, where the stack keeps it alive
+        int s = IS_OBJECT(STACK_PEEK(0)) ? 0 : 1;
+        STACK_PEEK(s) =
+            OBJECT_VAL(QxlString_flatten(vm, AS_OBJECT(STACK_PEEK(s))));
+        QxlString *str = QxlString_repeat(vm, AS_STRING(STACK_PEEK(s)),
+                                          AS_NUMBER(STACK_PEEK(1 - s)));
+        vm->stack_top -= 2;
+        vm_stack_push(vm, OBJECT_VAL(str));
+    }
+    else
+    {
+        runtime_error(vm,
+                      "RuntimeError: Unsupported operand types(s) for * : "
+                      "'%s' and '%s'",
+                      Qxl_TYPE_NAME(STACK_PEEK(1)),
+                      Qxl_TYPE_NAME(STACK_PEEK(0)));
+        return false;
+    }
+
+    return true;
+}
+
+// Joins the `count` strings and numbers at `parts` into one string stored in
+// `result`. The parts keep their slots, which keep them alive while the string
+// is allocated.
+static bool
+build_string(VM *vm, QxlValue *parts, int count, QxlValue *result)
+{
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (IS_ANY_STRING(parts[i]))
+        {
+            length += QxlString_length(AS_OBJECT(parts[i]));
+        }
+        else if (IS_NUMBER(parts[i]))
+        {
+            char num[QXL_NUM_CHARS_MAX];
+            length += Qxl_num_format(num, AS_NUMBER(parts[i]));
+        }
+        else
+        {
+            runtime_error(
+                vm, "RuntimeError: Can only concatenate str (not '%s') to str",
+                Qxl_TYPE_NAME(parts[i]));
+            return false;
+        }
+    }
+
+    if (length > INT_MAX)
+    {
+        runtime_error(vm, "RuntimeError: String is too long");
+        return false;
+    }
+    *result = OBJECT_VAL(QxlString_build(vm, parts, count, (int)length));
+    return true;
+}
+
+// Stores a global through the write barrier of the nursery. The global slots
+// are the only old locations that can point to a young string, a slot is
+// remembered when it starts to hold one. A slot that already held a young
+// string has been remembered since the last minor collection.
+static inline void
+set_global(VM *vm, int slot, QxlValue value)
+{
+    QxlValue *global = &vm->global_values.values[slot];
+    if (VM_IS_YOUNG_VALUE(vm, value) && !VM_IS_YOUNG_VALUE(vm, *global))
+    {
+        QxlMem_remember_global(vm, slot);
+    }
+    *global = value;
+}
+
+// Shared by both interpreter loops, which keep the instruction pointer of the
+// running frame in a local `ip`.
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (frame->fn->chunk.constants.values[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define GLOBAL(slot) (vm->global_values.values[(slot)])
+#define GLOBAL_NAME(slot) (AS_CSTRING(vm->global_names.values[(slot)]))
+
+// Loops, calls and returns are the safe points where the nursery is collected:
+// every value the running code holds is on the stack or in a global there.
+#ifdef DEBUG_STRESS_GC
+#define SAFE_POINT()                                                           \
+    if (vm->nursery_top != vm->nursery) QxlMem_collect_nursery(vm)
+#else
+#define SAFE_POINT()                                                           \
+    if (vm->minor_gc_pending) QxlMem_collect_nursery(vm)
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                                    \
+    do                                                                         \
+    {                                                                          \
+        printf("          ");                                                  \
+        for (QxlValue *slot = vm->stack; slot < vm->stack_top; slot++)         \
+        {                                                                      \
+            printf("[ ");                                                      \
+            QxlValue_print(*slot);                                             \
+            printf(" ]");                                                      \
+        }                                                                      \
+        printf("\n");                                                          \
+        debug_disassemble_instruction(&frame->fn->chunk,                       \
+                                      (int)(ip - frame->fn->chunk.code));      \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+#if defined(DEBUG_TRACK_ALLOCATIONS) || defined(DEBUG_SAMPLE_ALLOCATIONS)
+static inline void
+track_instruction(const uint8_t *ip)
+{
+#ifdef DEBUG_TRACK_ALLOCATIONS
+    QxlMem_current_op = *ip;
+#endif
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+    QxlMem_current_ip = ip;
+#endif
+}
+#define TRACK_INSTRUCTION() track_instruction(ip)
+#else
+#define TRACK_INSTRUCTION() ((void)0)
+#endif
+
+// a >= b and a <= b are !(a < b) and !(a > b), the OP_LESS, OP_NOT and
+// OP_GREATER, OP_NOT pairs they are fused from, so a NaN operand still makes
+// them true
+#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+
+#ifdef COMPUTED_GOTO
+// Direct threaded dispatch, every handler ends by jumping straight to the
+// handler of the next instruction instead of going back to a shared switch.
+// This gives the branch predictor one indirect jump per opcode. Each loop
+// defines its own `dispatch_table`.
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) L_##op
+#define DISPATCH()                                                             \
+    do                                                                         \
+    {                                                                          \
+        TRACE_INSTRUCTION();                                                   \
+        TRACK_INSTRUCTION();                                                   \
+        goto *dispatch_table[READ_BYTE()];                                     \
+    } while (false)
+#else
+#define INTERPRET_LOOP                                                         \
+    loop:                                                                      \
+    TRACE_INSTRUCTION();                                                       \
+    TRACK_INSTRUCTION();                                                       \
+    switch (READ_BYTE())
+#define CASE(op) case op
+#define DISPATCH() goto loop
+#endif
+
 static InterpretResult
 run(VM *vm)
 {
     CallFrame *frame     = &vm->frames[vm->frame_count - 1];
     register uint8_t *ip = frame->ip;
 
-#define READ_BYTE() (*ip++)
-#define READ_CONSTANT() (frame->fn->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define BINARY_OP(value_type, op)                                              \
     do                                                                         \
     {                                                                          \
@@ -165,275 +661,700 @@ run(VM *vm)
         vm_stack_push(vm, value_type(a op b));                                 \
     } while (false)
 
-#define BINARY_OP_(value_type, op, error)                                      \
+// Rewrites the instruction being executed into `op` and runs it again. Generic
+// instructions specialize themselves this way the first time they see two
+// numbers, and the specialized ones fall back when their guard fails.
+#define REQUICKEN(op) (ip[-1] = (op), ip--)
+#define QUICKEN_IF_NUMBERS(op)                                                 \
     do                                                                         \
     {                                                                          \
-        if (!IS_NUMBER(STACK_PEEK(0)) || !IS_NUMBER(STACK_PEEK(1)))            \
+        if (IS_NUMBER(STACK_PEEK(0)) && IS_NUMBER(STACK_PEEK(1)))              \
         {                                                                      \
-            frame->ip = ip;                                                    \
-            runtime_error(vm, (error));                                        \
-            free(error);                                                       \
-            return INTERPRET_RUNTIME_ERROR;                                    \
+            REQUICKEN(op);                                                     \
+            DISPATCH();                                                        \
         }                                                                      \
-        double b = AS_NUMBER(vm_stack_pop(vm));                                \
-        double a = AS_NUMBER(vm_stack_pop(vm));                                \
-        vm_stack_push(vm, value_type(a op b));                                 \
+    } while (false)
+#define NUMBER_OP(value_type, op, generic)                                     \
+    do                                                                         \
+    {                                                                          \
+        QxlValue b = STACK_PEEK(0);                                            \
+        QxlValue a = STACK_PEEK(1);                                            \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                                    \
+        {                                                                      \
+            REQUICKEN(generic);                                                \
+            DISPATCH();                                                        \
+        }                                                                      \
+        vm->stack_top--;                                                       \
+        STACK_PEEK(0) = value_type(AS_NUMBER(a) op AS_NUMBER(b));              \
     } while (false)
 
-    for (;;)
-    {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (QxlValue *slot = vm->stack; slot < vm->stack_top; slot++)
-        {
-            printf("[ ");
-            QxlValue_print(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        debug_disassemble_instruction(&frame->fn->chunk,
-                                      (int)(frame->ip - frame->fn->chunk.code));
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [OP_CONSTANT]              = &&L_OP_CONSTANT,
+        [OP_NEGATE]                = &&L_OP_NEGATE,
+        [OP_NOT]                   = &&L_OP_NOT,
+        [OP_ADD]                   = &&L_OP_ADD,
+        [OP_SUBTRACT]              = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY]              = &&L_OP_MULTIPLY,
+        [OP_DIVIDE]                = &&L_OP_DIVIDE,
+        [OP_RETURN]                = &&L_OP_RETURN,
+        [OP_NIL]                   = &&L_OP_NIL,
+        [OP_TRUE]                  = &&L_OP_TRUE,
+        [OP_FALSE]                 = &&L_OP_FALSE,
+        [OP_EQUAL]                 = &&L_OP_EQUAL,
+        [OP_GREATER]               = &&L_OP_GREATER,
+        [OP_LESS]                  = &&L_OP_LESS,
+        [OP_PRINT]                 = &&L_OP_PRINT,
+        [OP_POP]                   = &&L_OP_POP,
+        [OP_DUP]                   = &&L_OP_DUP,
+        [OP_DEFINE_GLOBAL]         = &&L_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]            = &&L_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL]            = &&L_OP_SET_GLOBAL,
+        [OP_GET_LOCAL]             = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL]             = &&L_OP_SET_LOCAL,
+        [OP_JUMP]                  = &&L_OP_JUMP,
+        [OP_JUMP_IF_FALSE]         = &&L_OP_JUMP_IF_FALSE,
+        [OP_LOOP]                  = &&L_OP_LOOP,
+        [OP_CALL]                  = &&L_OP_CALL,
+        [OP_TAIL_CALL]             = &&L_OP_TAIL_CALL,
+        [OP_BUILD_STRING]          = &&L_OP_BUILD_STRING,
+        [OP_NOT_EQUAL]             = &&L_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL]         = &&L_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL]            = &&L_OP_LESS_EQUAL,
+        [OP_ADD_LOCALS]            = &&L_OP_ADD_LOCALS,
+        [OP_SET_LOCAL_POP]         = &&L_OP_SET_LOCAL_POP,
+        [OP_POP_JUMP_IF_FALSE]     = &&L_OP_POP_JUMP_IF_FALSE,
+        [OP_LESS_LOCAL_CONST_JUMP] = &&L_OP_LESS_LOCAL_CONST_JUMP,
+        [OP_ADD_NUMBER]            = &&L_OP_ADD_NUMBER,
+        [OP_SUBTRACT_NUMBER]       = &&L_OP_SUBTRACT_NUMBER,
+        [OP_GREATER_NUMBER]        = &&L_OP_GREATER_NUMBER,
+        [OP_LESS_NUMBER]           = &&L_OP_LESS_NUMBER,
+        [OP_GREATER_EQUAL_NUMBER]  = &&L_OP_GREATER_EQUAL_NUMBER,
+        [OP_LESS_EQUAL_NUMBER]     = &&L_OP_LESS_EQUAL_NUMBER,
+        [OP_CALL_BUILTIN]          = &&L_OP_CALL_BUILTIN,
+    };
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
+
+    INTERPRET_LOOP
+    {
+    CASE(OP_CONSTANT):
+    {
+        QxlValue constant = READ_CONSTANT();
+        vm_stack_push(vm, constant);
+        DISPATCH();
+    }
+    CASE(OP_NIL):
+        vm_stack_push(vm, NIL_VAL);
+        DISPATCH();
+    CASE(OP_TRUE):
+        vm_stack_push(vm, BOOL_VAL(true));
+        DISPATCH();
+    CASE(OP_FALSE):
+        vm_stack_push(vm, BOOL_VAL(false));
+        DISPATCH();
+    CASE(OP_EQUAL):
+    {
+        QxlValue b = vm_stack_pop(vm);
+        QxlValue a = vm_stack_pop(vm);
+        vm_stack_push(vm, BOOL_VAL(QxlValue_are_equal(a, b)));
+        DISPATCH();
+    }
+    CASE(OP_GREATER):
+        QUICKEN_IF_NUMBERS(OP_GREATER_NUMBER);
+        BINARY_OP(BOOL_VAL, >);
+        DISPATCH();
+    CASE(OP_GREATER_NUMBER):
+        NUMBER_OP(BOOL_VAL, >, OP_GREATER);
+        DISPATCH();
+    CASE(OP_LESS):
+        QUICKEN_IF_NUMBERS(OP_LESS_NUMBER);
+        BINARY_OP(BOOL_VAL, <);
+        DISPATCH();
+    CASE(OP_LESS_NUMBER):
+        NUMBER_OP(BOOL_VAL, <, OP_LESS);
+        DISPATCH();
+    CASE(OP_NOT_EQUAL):
+    {
+        QxlValue b = vm_stack_pop(vm);
+        QxlValue a = vm_stack_pop(vm);
+        vm_stack_push(vm, BOOL_VAL(!QxlValue_are_equal(a, b)));
+        DISPATCH();
+    }
+    CASE(OP_GREATER_EQUAL):
+        QUICKEN_IF_NUMBERS(OP_GREATER_EQUAL_NUMBER);
+        BINARY_OP(NOT_BOOL_VAL, <);
+        DISPATCH();
+    CASE(OP_GREATER_EQUAL_NUMBER):
+        NUMBER_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL);
+        DISPATCH();
+    CASE(OP_LESS_EQUAL):
+        QUICKEN_IF_NUMBERS(OP_LESS_EQUAL_NUMBER);
+        BINARY_OP(NOT_BOOL_VAL, >);
+        DISPATCH();
+    CASE(OP_LESS_EQUAL_NUMBER):
+        NUMBER_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL);
+        DISPATCH();
+    CASE(OP_ADD):
+        QUICKEN_IF_NUMBERS(OP_ADD_NUMBER);
+        frame->ip = ip;
+        if (!add_values(vm)) return INTERPRET_RUNTIME_ERROR;
+        DISPATCH();
+    CASE(OP_ADD_NUMBER):
+        NUMBER_OP(NUMBER_VAL, +, OP_ADD);
+        DISPATCH();
+    CASE(OP_BUILD_STRING):
+    {
+        int count       = READ_BYTE();
+        QxlValue *parts = vm->stack_top - count;
+        frame->ip       = ip;
+        if (!build_string(vm, parts, count, parts))
         {
-        case OP_CONSTANT:
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        vm->stack_top = parts + 1;
+        DISPATCH();
+    }
+    CASE(OP_ADD_LOCALS):
+    {
+        QxlValue a = frame->slots[READ_BYTE()];
+        QxlValue b = frame->slots[READ_BYTE()];
+        if (IS_NUMBER(a) && IS_NUMBER(b))
         {
-            QxlValue constant = READ_CONSTANT();
-            vm_stack_push(vm, constant);
-            break;
+            vm_stack_push(vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            DISPATCH();
         }
-        case OP_NIL:
-            vm_stack_push(vm, NIL_VAL);
-            break;
-        case OP_TRUE:
-            vm_stack_push(vm, BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            vm_stack_push(vm, BOOL_VAL(false));
-            break;
-        case OP_EQUAL:
+
+        vm_stack_push(vm, a);
+        vm_stack_push(vm, b);
+        frame->ip = ip;
+        if (!add_values(vm)) return INTERPRET_RUNTIME_ERROR;
+        DISPATCH();
+    }
+    CASE(OP_SUBTRACT):
+        QUICKEN_IF_NUMBERS(OP_SUBTRACT_NUMBER);
+        BINARY_OP(NUMBER_VAL, -);
+        DISPATCH();
+    CASE(OP_SUBTRACT_NUMBER):
+        NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT);
+        DISPATCH();
+    CASE(OP_MULTIPLY):
+        frame->ip = ip;
+        if (!multiply_values(vm)) return INTERPRET_RUNTIME_ERROR;
+        DISPATCH();
+    CASE(OP_DIVIDE):
+        BINARY_OP(NUMBER_VAL, /);
+        DISPATCH();
+    CASE(OP_NOT):
+        vm_stack_push(vm, BOOL_VAL(is_falsey(vm_stack_pop(vm))));
+        DISPATCH();
+    CASE(OP_NEGATE):
+        if (!IS_NUMBER(STACK_PEEK(0)))
         {
-            QxlValue b = vm_stack_pop(vm);
-            QxlValue a = vm_stack_pop(vm);
-            vm_stack_push(vm, BOOL_VAL(QxlValue_are_equal(a, b)));
-            break;
+            frame->ip = ip;
+            runtime_error(vm, "operand must be a number");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD:
-        {
-            // String concatination
-            if (IS_STRING(STACK_PEEK(0)) && IS_STRING(STACK_PEEK(1)))
-            {
-                QxlValue b = vm_stack_pop(vm);
-                QxlValue a = vm_stack_pop(vm);
-                QxlString *str =
-                    QxlString_concatenate(vm, AS_STRING(a), AS_STRING(b));
-                vm_stack_push(vm, OBJECT_VAL(str));
-            }
-            else if ((IS_STRING(STACK_PEEK(0)) && IS_NUMBER(STACK_PEEK(1))) ||
-                     (IS_NUMBER(STACK_PEEK(0)) && IS_STRING(STACK_PEEK(1))))
-            {
-                QxlValue str_op;
-                QxlString *num_op, *str;
-                if (IS_OBJECT(STACK_PEEK(0)))
-                {
-                    str_op   = vm_stack_pop(vm);
-                    char *ds = Qxl_num_as_str(AS_NUMBER(vm_stack_pop(vm)));
-                    num_op   = QxlString_copy(vm, ds, strlen(ds));
-                    str = QxlString_concatenate(vm, num_op, AS_STRING(str_op));
-                }
-                else
-                {
-                    char *ds = Qxl_num_as_str(AS_NUMBER(vm_stack_pop(vm)));
-                    num_op   = QxlString_copy(vm, ds, strlen(ds));
-                    str_op   = vm_stack_pop(vm);
-                    str = QxlString_concatenate(vm, AS_STRING(str_op), num_op);
-                }
-                vm_stack_push(vm, OBJECT_VAL(str));
-            }
-            else if (IS_STRING(STACK_PEEK(0)) || IS_STRING(STACK_PEEK(1)))
-            {
-                frame->ip = ip;
-                runtime_error(
-                    vm,
-                    "RuntimeError: Can only concatenate str (not '%s') to str",
-                    Qxl_TYPE_NAME(
-                        STACK_PEEK(IS_STRING(STACK_PEEK(0)) ? 1 : 0)));
-            }
-            else
-            {
-                char *error = Qxl_fstr("RuntimeError: Unsupported operand "
-                                       "types(s) for + : '%s' and '%s'",
-                                       Qxl_TYPE_NAME(STACK_PEEK(1)),
-                                       Qxl_TYPE_NAME(STACK_PEEK(0)));
-                BINARY_OP_(NUMBER_VAL, +, error);
-            }
-            break;
+        vm_stack_push(vm, NUMBER_VAL(-AS_NUMBER(vm_stack_pop(vm))));
+        DISPATCH();
+    CASE(OP_PRINT):
+    {
+        QxlValue_print(vm_stack_pop(vm));
+        printf("\n");
+        DISPATCH();
+    }
+    CASE(OP_POP):
+        vm_stack_pop(vm);
+        DISPATCH();
+    CASE(OP_DUP):
+        vm_stack_push(vm, STACK_PEEK(0));
+        DISPATCH();
+    CASE(OP_DEFINE_GLOBAL):
+        set_global(vm, READ_SHORT(), STACK_PEEK(0));
+        vm->stack_top--;
+        DISPATCH();
+    CASE(OP_GET_GLOBAL):
+    {
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(GLOBAL(slot)))
+        {
+            frame->ip = ip;
+            runtime_error(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot));
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-        {
-            if (IS_STRING(STACK_PEEK(0)) && IS_NUMBER(STACK_PEEK(1)) ||
-                IS_NUMBER(STACK_PEEK(0)) && IS_STRING(STACK_PEEK(1)))
-            {
-                QxlValue l = vm_stack_pop(vm);
-                QxlValue r = vm_stack_pop(vm);
-                QxlString *str =
-                    QxlString_repeat(vm, AS_STRING((IS_OBJECT(l) ? l : r)),
-                                     AS_NUMBER(IS_OBJECT(l) ? r : l));
-                vm_stack_push(vm, OBJECT_VAL(str));
-            }
-            else
-            {
-                char *error = Qxl_fstr("RuntimeError: Unsupported operand "
-                                       "types(s) for * : '%s' and '%s'",
-                                       Qxl_TYPE_NAME(STACK_PEEK(1)),
-                                       Qxl_TYPE_NAME(STACK_PEEK(0)));
-                BINARY_OP_(NUMBER_VAL, /, error);
-                free(error);
-            }
-            break;
+        vm_stack_push(vm, GLOBAL(slot));
+        DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL):
+    {
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(GLOBAL(slot)))
+        {
+            frame->ip = ip;
+            runtime_error(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot));
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            vm_stack_push(vm, BOOL_VAL(is_falsey(vm_stack_pop(vm))));
-            break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(STACK_PEEK(0)))
-            {
-                frame->ip = ip;
-                runtime_error(vm, "operand must be a number");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            vm_stack_push(vm, NUMBER_VAL(-AS_NUMBER(vm_stack_pop(vm))));
-            break;
-        case OP_PRINT:
+        set_global(vm, slot, STACK_PEEK(0));
+        DISPATCH();
+    }
+    CASE(OP_GET_LOCAL):
+    {
+        uint8_t slot = READ_BYTE();
+        vm_stack_push(vm, frame->slots[slot]);
+        DISPATCH();
+    }
+    CASE(OP_SET_LOCAL):
+    {
+        uint8_t slot       = READ_BYTE();
+        frame->slots[slot] = STACK_PEEK(0);
+        DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP):
+    {
+        uint8_t slot       = READ_BYTE();
+        frame->slots[slot] = vm_stack_pop(vm);
+        DISPATCH();
+    }
+    CASE(OP_JUMP):
+    {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE):
+    {
+        uint16_t offset = READ_SHORT();
+        if (is_falsey(STACK_PEEK(0))) ip += offset;
+        DISPATCH();
+    }
+    CASE(OP_POP_JUMP_IF_FALSE):
+    {
+        uint16_t offset = READ_SHORT();
+        if (is_falsey(vm_stack_pop(vm))) ip += offset;
+        DISPATCH();
+    }
+    CASE(OP_LESS_LOCAL_CONST_JUMP):
+    {
+        QxlValue a      = frame->slots[READ_BYTE()];
+        QxlValue b      = READ_CONSTANT();
+        uint16_t offset = READ_SHORT();
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))
         {
-            QxlValue_print(vm_stack_pop(vm));
-            printf("\n");
-            break;
+            frame->ip = ip;
+            runtime_error(vm, "operands must be numbers");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_POP:
-            vm_stack_pop(vm);
-            break;
-        case OP_DUP:
-            vm_stack_push(vm, STACK_PEEK(0));
-            break;
-        case OP_DEFINE_GLOBAL:
+        if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+        DISPATCH();
+    }
+    CASE(OP_LOOP):
+    {
+        SAFE_POINT();
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        DISPATCH();
+    }
+    CASE(OP_CALL):
+    CASE(OP_TAIL_CALL):
+    {
+        SAFE_POINT();
+        bool tail = ip[-1] == OP_TAIL_CALL;
+        if (!tail && IS_BUILTIN(STACK_PEEK(ip[0])))
         {
-            QxlString *name = READ_STRING();
-            QxlHashTable_put(&vm->globals, name, STACK_PEEK(0));
-            vm_stack_pop(vm);
-            break;
+            REQUICKEN(OP_CALL_BUILTIN);
+            DISPATCH();
         }
-        case OP_GET_GLOBAL:
-        {
-            QxlString *name = READ_STRING();
-            QxlValue value;
-            if (!QxlHashTable_get(&vm->globals, name, &value))
-            {
-                frame->ip = ip;
-                runtime_error(vm, "Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            vm_stack_push(vm, value);
-            break;
+
+        int arg_count = READ_BYTE();
+        frame->ip     = ip;
+        if (!call_value(vm, STACK_PEEK(arg_count), arg_count, tail))
+        {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SET_GLOBAL:
+        frame = &vm->frames[vm->frame_count - 1];
+        ip    = frame->ip;
+        DISPATCH();
+    }
+    CASE(OP_CALL_BUILTIN):
+    {
+        SAFE_POINT();
+        // Builtins never push a frame, so frame and ip stay as they are
+        QxlValue callee = STACK_PEEK(ip[0]);
+        if (!IS_BUILTIN(callee))
         {
-            QxlString *name = READ_STRING();
-            if (QxlHashTable_put(&vm->globals, name, STACK_PEEK(0)))
-            {
-                QxlHashTable_remove(&vm->globals, name);
-                frame->ip = ip;
-                runtime_error(vm, "Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
+            REQUICKEN(OP_CALL);
+            DISPATCH();
         }
-        case OP_GET_LOCAL:
+
+        int arg_count = READ_BYTE();
+        frame->ip     = ip;
+        if (!call_builtin(vm, AS_BUILTIN(callee), arg_count))
         {
-            uint8_t slot = READ_BYTE();
-            vm_stack_push(vm, frame->slots[slot]);
-            break;
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SET_LOCAL:
+        DISPATCH();
+    }
+    CASE(OP_RETURN):
+    {
+        SAFE_POINT();
+        QxlValue result = vm_stack_pop(vm);
+        vm->frame_count--;
+        if (vm->frame_count == 0)
         {
-            uint8_t slot       = READ_BYTE();
-            frame->slots[slot] = STACK_PEEK(0);
-            break;
+            vm_stack_pop(vm);
+            return INTERPRET_OK;
         }
-        case OP_JUMP:
+
+        vm->stack_top = frame->slots;
+        vm_stack_push(vm, result);
+        frame = &vm->frames[vm->frame_count - 1];
+        ip    = frame->ip;
+        DISPATCH();
+    }
+    }
+
+    return INTERPRET_RUNTIME_ERROR; // Unreachable
+
+#undef BINARY_OP
+#undef REQUICKEN
+#undef QUICKEN_IF_NUMBERS
+#undef NUMBER_OP
+}
+
+// Fills the registers from the stack top up to `top` with nil and leaves the
+// stack top there. Registers a frame has not written yet can still hold values
+// of frames that have returned, which the collector may have freed since.
+static inline void
+clear_registers(VM *vm, QxlValue *top)
+{
+    while (vm->stack_top < top)
+    {
+        *vm->stack_top++ = NIL_VAL;
+    }
+    vm->stack_top = top;
+}
+
+// Runs the three-address instructions produced in register mode. Operands
+// index the slots of the running frame directly. The stack pointer is kept
+// above the registers of the frame, so the helpers and builtins that work on
+// the stack can still push and pop there.
+static InterpretResult
+run_register(VM *vm)
+{
+    CallFrame *frame     = &vm->frames[vm->frame_count - 1];
+    register uint8_t *ip = frame->ip;
+    QxlValue *slots      = frame->slots;
+
+#define BINARY_OP(value_type, op)                                              \
+    do                                                                         \
+    {                                                                          \
+        QxlValue *dest = &slots[READ_BYTE()];                                  \
+        QxlValue a     = slots[READ_BYTE()];                                   \
+        QxlValue b     = slots[READ_BYTE()];                                   \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                                    \
+        {                                                                      \
+            frame->ip = ip;                                                    \
+            runtime_error(vm, "operands must be numbers");                     \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        *dest = value_type(AS_NUMBER(a) op AS_NUMBER(b));                      \
+    } while (false)
+
+// Numbers are handled inline, anything else goes through the stack based
+// `helper` shared with the stack loop.
+#define STACK_OP(op, helper)                                                   \
+    do                                                                         \
+    {                                                                          \
+        QxlValue *dest = &slots[READ_BYTE()];                                  \
+        QxlValue a     = slots[READ_BYTE()];                                   \
+        QxlValue b     = slots[READ_BYTE()];                                   \
+        if (IS_NUMBER(a) && IS_NUMBER(b))                                      \
+        {                                                                      \
+            *dest = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b));                  \
+            DISPATCH();                                                        \
+        }                                                                      \
+        frame->ip = ip;                                                        \
+        vm_stack_push(vm, a);                                                  \
+        vm_stack_push(vm, b);                                                  \
+        if (!helper(vm)) return INTERPRET_RUNTIME_ERROR;                       \
+        *dest = vm_stack_pop(vm);                                              \
+    } while (false)
+
+#define EQUALITY_OP(op)                                                        \
+    do                                                                         \
+    {                                                                          \
+        QxlValue *dest = &slots[READ_BYTE()];                                  \
+        QxlValue a     = slots[READ_BYTE()];                                   \
+        QxlValue b     = slots[READ_BYTE()];                                   \
+        *dest          = BOOL_VAL(QxlValue_are_equal(a, b) op true);           \
+    } while (false)
+
+#define LESS_JUMP(a, b)                                                        \
+    do                                                                         \
+    {                                                                          \
+        uint16_t offset = READ_SHORT();                                        \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                                    \
+        {                                                                      \
+            frame->ip = ip;                                                    \
+            runtime_error(vm, "operands must be numbers");                     \
+            return INTERPRET_RUNTIME_ERROR;                                    \
+        }                                                                      \
+        if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;                      \
+    } while (false)
+
+#ifdef COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [OP_R_MOVE]               = &&L_OP_R_MOVE,
+        [OP_R_LOADK]              = &&L_OP_R_LOADK,
+        [OP_R_NIL]                = &&L_OP_R_NIL,
+        [OP_R_TRUE]               = &&L_OP_R_TRUE,
+        [OP_R_FALSE]              = &&L_OP_R_FALSE,
+        [OP_R_ADD]                = &&L_OP_R_ADD,
+        [OP_R_SUBTRACT]           = &&L_OP_R_SUBTRACT,
+        [OP_R_MULTIPLY]           = &&L_OP_R_MULTIPLY,
+        [OP_R_DIVIDE]             = &&L_OP_R_DIVIDE,
+        [OP_R_EQUAL]              = &&L_OP_R_EQUAL,
+        [OP_R_NOT_EQUAL]          = &&L_OP_R_NOT_EQUAL,
+        [OP_R_GREATER]            = &&L_OP_R_GREATER,
+        [OP_R_GREATER_EQUAL]      = &&L_OP_R_GREATER_EQUAL,
+        [OP_R_LESS]               = &&L_OP_R_LESS,
+        [OP_R_LESS_EQUAL]         = &&L_OP_R_LESS_EQUAL,
+        [OP_R_NOT]                = &&L_OP_R_NOT,
+        [OP_R_NEGATE]             = &&L_OP_R_NEGATE,
+        [OP_R_PRINT]              = &&L_OP_R_PRINT,
+        [OP_R_DEFINE_GLOBAL]      = &&L_OP_R_DEFINE_GLOBAL,
+        [OP_R_GET_GLOBAL]         = &&L_OP_R_GET_GLOBAL,
+        [OP_R_SET_GLOBAL]         = &&L_OP_R_SET_GLOBAL,
+        [OP_R_JUMP]               = &&L_OP_R_JUMP,
+        [OP_R_JUMP_IF_FALSE]      = &&L_OP_R_JUMP_IF_FALSE,
+        [OP_R_JUMP_IF_NOT_LESS]   = &&L_OP_R_JUMP_IF_NOT_LESS,
+        [OP_R_JUMP_IF_NOT_LESS_K] = &&L_OP_R_JUMP_IF_NOT_LESS_K,
+        [OP_R_LOOP]               = &&L_OP_R_LOOP,
+        [OP_R_CALL]               = &&L_OP_R_CALL,
+        [OP_R_TAIL_CALL]          = &&L_OP_R_TAIL_CALL,
+        [OP_R_RETURN]             = &&L_OP_R_RETURN,
+        [OP_R_BUILD_STRING]       = &&L_OP_R_BUILD_STRING,
+    };
+#endif
+
+    INTERPRET_LOOP
+    {
+    CASE(OP_R_MOVE):
+    {
+        uint8_t a = READ_BYTE();
+        slots[a]  = slots[READ_BYTE()];
+        DISPATCH();
+    }
+    CASE(OP_R_LOADK):
+    {
+        uint8_t a = READ_BYTE();
+        slots[a]  = READ_CONSTANT();
+        DISPATCH();
+    }
+    CASE(OP_R_NIL):
+        slots[READ_BYTE()] = NIL_VAL;
+        DISPATCH();
+    CASE(OP_R_TRUE):
+        slots[READ_BYTE()] = BOOL_VAL(true);
+        DISPATCH();
+    CASE(OP_R_FALSE):
+        slots[READ_BYTE()] = BOOL_VAL(false);
+        DISPATCH();
+    CASE(OP_R_ADD):
+        STACK_OP(+, add_values);
+        DISPATCH();
+    CASE(OP_R_BUILD_STRING):
+    {
+        QxlValue *dest  = &slots[READ_BYTE()];
+        QxlValue *parts = &slots[READ_BYTE()];
+        int count       = READ_BYTE();
+        frame->ip       = ip;
+        if (!build_string(vm, parts, count, dest))
         {
-            uint16_t offset = READ_SHORT();
-            ip += offset;
-            break;
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_JUMP_IF_FALSE:
+        DISPATCH();
+    }
+    CASE(OP_R_SUBTRACT):
+        BINARY_OP(NUMBER_VAL, -);
+        DISPATCH();
+    CASE(OP_R_MULTIPLY):
+        STACK_OP(*, multiply_values);
+        DISPATCH();
+    CASE(OP_R_DIVIDE):
+        BINARY_OP(NUMBER_VAL, /);
+        DISPATCH();
+    CASE(OP_R_EQUAL):
+        EQUALITY_OP(==);
+        DISPATCH();
+    CASE(OP_R_NOT_EQUAL):
+        EQUALITY_OP(!=);
+        DISPATCH();
+    CASE(OP_R_GREATER):
+        BINARY_OP(BOOL_VAL, >);
+        DISPATCH();
+    CASE(OP_R_GREATER_EQUAL):
+        BINARY_OP(NOT_BOOL_VAL, <);
+        DISPATCH();
+    CASE(OP_R_LESS):
+        BINARY_OP(BOOL_VAL, <);
+        DISPATCH();
+    CASE(OP_R_LESS_EQUAL):
+        BINARY_OP(NOT_BOOL_VAL, >);
+        DISPATCH();
+    CASE(OP_R_NOT):
+    {
+        uint8_t a = READ_BYTE();
+        slots[a]  = BOOL_VAL(is_falsey(slots[READ_BYTE()]));
+        DISPATCH();
+    }
+    CASE(OP_R_NEGATE):
+    {
+        uint8_t a  = READ_BYTE();
+        QxlValue b = slots[READ_BYTE()];
+        if (!IS_NUMBER(b))
         {
-            uint16_t offset = READ_SHORT();
-            if (is_falsey(STACK_PEEK(0))) ip += offset;
-            break;
+            frame->ip = ip;
+            runtime_error(vm, "operand must be a number");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_LOOP:
+        slots[a] = NUMBER_VAL(-AS_NUMBER(b));
+        DISPATCH();
+    }
+    CASE(OP_R_PRINT):
+        QxlValue_print(slots[READ_BYTE()]);
+        printf("\n");
+        DISPATCH();
+    CASE(OP_R_DEFINE_GLOBAL):
+    {
+        QxlValue value = slots[READ_BYTE()];
+        uint16_t slot  = READ_SHORT();
+        set_global(vm, slot, value);
+        DISPATCH();
+    }
+    CASE(OP_R_GET_GLOBAL):
+    {
+        uint8_t a     = READ_BYTE();
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(GLOBAL(slot)))
         {
-            uint16_t offset = READ_SHORT();
-            ip -= offset;
-            break;
+            frame->ip = ip;
+            runtime_error(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot));
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_CALL:
+        slots[a] = GLOBAL(slot);
+        DISPATCH();
+    }
+    CASE(OP_R_SET_GLOBAL):
+    {
+        QxlValue value = slots[READ_BYTE()];
+        uint16_t slot  = READ_SHORT();
+        if (IS_UNDEFINED(GLOBAL(slot)))
         {
-            int arg_count = READ_BYTE();
-            frame->ip     = ip;
-            if (!call_value(vm, STACK_PEEK(arg_count), arg_count))
-            {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm->frames[vm->frame_count - 1];
-            ip    = frame->ip;
-            break;
+            frame->ip = ip;
+            runtime_error(vm, "Undefined variable '%s'.", GLOBAL_NAME(slot));
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_RETURN:
+        set_global(vm, slot, value);
+        DISPATCH();
+    }
+    CASE(OP_R_JUMP):
+    {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+    }
+    CASE(OP_R_JUMP_IF_FALSE):
+    {
+        QxlValue a      = slots[READ_BYTE()];
+        uint16_t offset = READ_SHORT();
+        if (is_falsey(a)) ip += offset;
+        DISPATCH();
+    }
+    CASE(OP_R_JUMP_IF_NOT_LESS):
+    {
+        QxlValue a = slots[READ_BYTE()];
+        QxlValue b = slots[READ_BYTE()];
+        LESS_JUMP(a, b);
+        DISPATCH();
+    }
+    CASE(OP_R_JUMP_IF_NOT_LESS_K):
+    {
+        QxlValue a = slots[READ_BYTE()];
+        QxlValue b = READ_CONSTANT();
+        LESS_JUMP(a, b);
+        DISPATCH();
+    }
+    CASE(OP_R_LOOP):
+    {
+        SAFE_POINT();
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        DISPATCH();
+    }
+    CASE(OP_R_CALL):
+    CASE(OP_R_TAIL_CALL):
+    {
+        SAFE_POINT();
+        bool tail     = ip[-1] == OP_R_TAIL_CALL;
+        uint8_t base  = READ_BYTE();
+        int arg_count = READ_BYTE();
+        frame->ip     = ip;
+        vm->stack_top = slots + base + arg_count + 1;
+        if (!call_value(vm, slots[base], arg_count, tail))
         {
-            QxlValue result = vm_stack_pop(vm);
-            vm->frame_count--;
-            if (vm->frame_count == 0)
-            {
-                vm_stack_pop(vm);
-                return INTERPRET_OK;
-            }
-
-            vm->stack_top = frame->slots;
-            vm_stack_push(vm, result);
-            frame = &vm->frames[vm->frame_count - 1];
-            ip    = frame->ip;
-            break;
+            return INTERPRET_RUNTIME_ERROR;
         }
+        frame = &vm->frames[vm->frame_count - 1];
+        ip    = frame->ip;
+        slots = frame->slots;
+        clear_registers(vm, slots + frame->fn->max_stack);
+        DISPATCH();
+    }
+    CASE(OP_R_RETURN):
+    {
+        SAFE_POINT();
+        QxlValue result = slots[READ_BYTE()];
+        vm->frame_count--;
+        if (vm->frame_count == 0)
+        {
+            vm->stack_top = slots;
+            return INTERPRET_OK;
         }
+
+        // The callee's slot 0 is the register the caller called from
+        slots[0]      = result;
+        frame         = &vm->frames[vm->frame_count - 1];
+        ip            = frame->ip;
+        slots         = frame->slots;
+        vm->stack_top = slots + frame->fn->max_stack;
+        DISPATCH();
+    }
     }
 
+    return INTERPRET_RUNTIME_ERROR; // Unreachable
+
+#undef BINARY_OP
+#undef STACK_OP
+#undef EQUALITY_OP
+#undef LESS_JUMP
+}
+
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
-#undef BINARY_OP
-#undef READ_STRING
-}
+#undef GLOBAL
+#undef GLOBAL_NAME
+#undef SAFE_POINT
+#undef TRACE_INSTRUCTION
+#undef TRACK_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 
-InterpretResult
-vm_interpret(VM *vm, const char *src)
+static InterpretResult
+interpret(VM *vm, const char *src)
 {
-
     QxlFunction *fn = compile(src, vm);
     if (fn == NULL)
     {
@@ -442,7 +1363,80 @@ vm_interpret(VM *vm, const char *src)
 
     vm_stack_push(vm, OBJECT_VAL(fn));
     call(vm, fn, 0);
-    return run(vm);
+
+    InterpretResult result;
+    if (vm->register_mode)
+    {
+        clear_registers(vm, vm->stack + fn->max_stack);
+        result = run_register(vm);
+    }
+    else
+    {
+        result = run(vm);
+    }
+    return result;
+}
+
+// Unwinds the compilation or run that ran out of memory. What it allocated
+// so far stays on the heap for the next collection to free.
+static InterpretResult
+recover_from_out_of_memory(VM *vm)
+{
+    if (vm->compiler != NULL)
+    {
+        QxlArena_free(vm->compiler->p->arena);
+        vm->compiler = NULL;
+    }
+
+    // A minor collection may have stopped half way, the strings it did not
+    // get to keep their place in the nursery and the forwarding pointers of
+    // the others are dropped
+    for (uint8_t *young = vm->nursery; young < vm->nursery_top;)
+    {
+        QxlString *string = (QxlString *)young;
+        string->obj.next  = NULL;
+        young += VM_NURSERY_ALIGN(QxlString_Size(string->length));
+    }
+    vm->evacuating = false;
+
+    // A global slot may have got its value but not its name
+    vm->global_values.count = vm->global_names.count;
+
+    if (vm->frame_count > 0)
+    {
+        // The instruction pointer of the innermost frame is only stored on
+        // calls, so the line reported is the one of its last call
+        runtime_error(vm, "Out of memory (heap limit is %zu bytes)",
+                      vm->max_bytes);
+    }
+    else
+    {
+        Qxl_ERROR("Out of memory while compiling (heap limit is %zu bytes)\n",
+                  vm->max_bytes);
+        vm_stack_reset(vm);
+    }
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+InterpretResult
+vm_interpret(VM *vm, const char *src)
+{
+    VM *previous = QxlMem_attach(vm);
+    jmp_buf out_of_memory;
+    vm->out_of_memory      = &out_of_memory;
+    InterpretResult result = setjmp(out_of_memory) == 0
+                                 ? interpret(vm, src)
+                                 : recover_from_out_of_memory(vm);
+    vm->out_of_memory      = NULL;
+
+#ifdef DEBUG_TRACK_ALLOCATIONS
+    QxlMem_current_op = -1;
+#endif
+#ifdef DEBUG_SAMPLE_ALLOCATIONS
+    QxlMem_current_ip = NULL;
+#endif
+    QxlMem_attach(previous);
+    return result;
 }
 
 void